@@ -124,8 +124,15 @@ int interpreter(char* command_args[], int args_size) {
         // Handle set command with multiple tokens for the value
         if (args_size < 3) return badcommand(); 
         
-        // Concatenate tokens starting from command_args[2] up to args_size
-        char value[MAX_USER_INPUT * MAX_TOKENS] = "";
+        // Concatenate tokens starting from command_args[2] up to args_size.
+        // Words can be any length, so size the value to fit them.
+        size_t value_size = 1;
+        for (i = 2; i < args_size; i++) {
+            value_size += strlen(command_args[i]) + 1;
+        }
+        char *value = malloc(value_size);
+        if (!value) return badcommand();
+        value[0] = '\0';
         for (i = 2; i < args_size; i++) {
             strcat(value, command_args[i]);
             if (i < args_size - 1) {
@@ -135,7 +142,9 @@ int interpreter(char* command_args[], int args_size) {
         }
 
         // Call set function with concatenated value
-        return set(command_args[1], value);
+        int errCode = set(command_args[1], value);
+        free(value);
+        return errCode;
     
     } else if (strcmp(command_args[0], "print") == 0) {
         if (args_size != 2) return badcommand();
@@ -194,7 +203,10 @@ int quit() {
 
 int set(char *var, char *value) {
     // Store the value (using your function to set the variable)
-    mem_set_value(var, value);
+    if (mem_set_value(var, value) != 0) {
+        printf("Bad command: variable memory is full\n");
+        return 1;
+    }
     return 0;
 }
 
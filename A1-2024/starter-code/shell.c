@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> 
@@ -8,14 +10,51 @@
 #include <ctype.h>
 #include <time.h>
 
-#define MAX_COMMANDS 10
-
 int parseInput(char ui[]);
 void init_backing_store();
 void init_frame_store();
 
+// Parse a byte count like 4096, 64K or 2M. Returns 0 on success.
+// (The same as A2's, so --var-budget means the same thing in both.)
+static int parse_size(const char *s, size_t *out) {
+    // strtoull would take "-1" (as the biggest size there is) and leading
+    // spaces; sizes are just digits.
+    if (*s < '0' || *s > '9') return -1;
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno == ERANGE || n > SIZE_MAX) return -1;
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0') return -1;
+    // Too big to be a size at all; don't let it wrap round to a small one.
+    if (n > (SIZE_MAX >> shift)) return -1;
+    *out = (size_t)n << shift;
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--var-budget BYTES]\n", argv0);
+    exit(1);
+}
+
 // Start of everything
 int main(int argc, char *argv[]) {
+    // Optional runtime cap on variable memory: mysh --var-budget BYTES,
+    // where BYTES may end in K, M or G.
+    size_t var_budget = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--var-budget") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &var_budget)) usage(argv[0]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
     // Initialize random seed
     srand(time(NULL));
     printf("Frame Store Size = %d; Variable Store Size = %d\n\n", FRAME_STORE_SIZE, VARIABLE_STORE_SIZE);
@@ -26,16 +65,13 @@ int main(int argc, char *argv[]) {
     init_frame_store();
 
     char prompt = '$';  				// Shell prompt
-    char userInput[MAX_USER_INPUT];		// user's input stored here 
+    char *userInput = NULL;				// user's input stored here; getline grows it
+    size_t userInputSize = 0;			// to fit lines of any length
     int errorCode = 0;					// zero means no error, default
-
-    //init user input
-    for (int i = 0; i < MAX_USER_INPUT; i++) {
-        userInput[i] = '\0';
-    }
     
     //init shell memory
     mem_init();
+    mem_set_budget(var_budget);
 
     // Determine if we are in batch mode (input is from a file) or interactive mode
     // Returns 1 if interactive, 0 if batch mode
@@ -47,17 +83,18 @@ int main(int argc, char *argv[]) {
             printf("%c ", prompt);
         }
 
-        if (fgets(userInput, MAX_USER_INPUT - 1, stdin) == NULL) {
+        if (getline(&userInput, &userInputSize, stdin) == -1) {
             // If we reach EOF in batch mode, break the loop and return to interactive mode
             if (!isInteractive) {
                 break;
             }
+            continue;
         }
 
         errorCode = parseInput(userInput);
         if (errorCode == -1) exit(99);	// ignore all other errors
-        memset(userInput, 0, sizeof(userInput));
     }
+    free(userInput);
 
     return 0;
 }
@@ -68,54 +105,72 @@ int wordEnding(char c) {
     return c == '\0' || c == '\n' || c == ' ';
 }
 
-int parseSingleInput(char inp[]) {
-    char tmp[200], *words[100];                            
-    int ix = 0, w = 0;
+// Parse and run the single command that is the len bytes at inp.
+int parseSingleInput(const char inp[], size_t len) {
+    // Remove leading and trailing spaces
+    while (len > 0 && isspace(*inp)) inp++, len--;
+    while (len > 0 && isspace(inp[len - 1])) len--;
+
+    // Words are copied into scratch, which is big enough for the command
+    // (every word is at least one byte shorter than the input it used up,
+    // counting its separator, plus its NUL). Usual commands fit on the
+    // stack, so they need no mallocs; only huge ones do.
+    // We copy rather than cutting up inp in place because inp is often a
+    // line of a script in the frame store, which has to survive being run.
+    char stack_scratch[MAX_USER_INPUT + 1], *words[100];
+    char *scratch = stack_scratch;
+    if (len + 1 > sizeof(stack_scratch)) {
+        scratch = malloc(len + 1);
+        if (!scratch) {
+            printf("Bad command: out of memory\n");
+            return 1;
+        }
+    }
+    size_t ix = 0;
+    int w = 0;
     int wordlen;
     int errorCode;
-    for (ix = 0; inp[ix] == ' ' && ix < 1000; ix++); // skip white spaces
-    while (inp[ix] != '\n' && inp[ix] != '\0' && ix < 1000) {
+    char *next = scratch;
+    while (ix < len && inp[ix] != '\n') {
         // extract a word
-        for (wordlen = 0; !wordEnding(inp[ix]) && ix < 1000; ix++, wordlen++) {
-            tmp[wordlen] = inp[ix];                        
+        for (wordlen = 0; ix < len && !wordEnding(inp[ix]); ix++, wordlen++) {
+            next[wordlen] = inp[ix];
         }
-        tmp[wordlen] = '\0';
-        words[w] = strdup(tmp);
+        next[wordlen] = '\0';
+        // Anything past 100 words is too many anyway; just count it.
+        if (w < 100) words[w] = next;
         w++;
-        if (inp[ix] == '\0') break;
+        next += wordlen + 1;
+        if (ix == len) break;
         ix++; 
     }
-    errorCode = interpreter(words, w);
+    errorCode = interpreter(words, w < 100 ? w : 100);
+    if (scratch != stack_scratch) free(scratch);
     return errorCode;
 }
 
 int parseInput(char inp[]) {
-    char *commands[MAX_COMMANDS]; 
-    int commandCount = 0;
-    char *command;
+    // Run each command as soon as we find its end, rather than splitting
+    // the whole chain up front: this needs no room for the commands, so a
+    // chain can be as long as you like, and it leaves inp untouched.
+    size_t pos = 0;
     int errorCode = 0;
 
-    // Split the input by semicolon (;)
-    command = strtok(inp, ";");
-    while (command != NULL && commandCount < 10) {
-        commands[commandCount++] = command;
-        command = strtok(NULL, ";");
-    }
-
-    // Execute each command one by one
-    for (int i = 0; i < commandCount; i++) {
-        // Remove leading and trailing spaces
-        char *trimmedCommand = commands[i];
-        while (isspace(*trimmedCommand)) trimmedCommand++;
-        char *end = trimmedCommand + strlen(trimmedCommand) - 1;
-        while (end > trimmedCommand && isspace(*end)) end--;
-        end[1] = '\0';
+    while (inp[pos] != '\0') {
+        // Skip empty commands, as in "a;;b".
+        if (inp[pos] == ';') {
+            pos++;
+            continue;
+        }
+        // Split the input by semicolon (;)
+        size_t len = strcspn(inp + pos, ";");
 
         // Parse and execute the now single command
-        errorCode = parseSingleInput(trimmedCommand);
+        errorCode = parseSingleInput(inp + pos, len);
         if (errorCode == -1) {
             break;  // Exit on fatal error (like `quit`)
         }
+        pos += len;
     }
 
     return errorCode;
@@ -9,7 +9,16 @@ struct memory_struct {
     char *value;
 };
 
-struct memory_struct shellmemory[VARIABLE_STORE_SIZE];
+// The store used to be a fixed array of VARIABLE_STORE_SIZE entries, and
+// mem_set_value silently did nothing once it was full. Now it starts with
+// room for VARIABLE_STORE_SIZE variables and doubles whenever it runs out.
+struct memory_struct *shellmemory = NULL;
+int mem_count = 0;      // Number of variables in use
+int mem_capacity = 0;   // Number of entries allocated
+
+// Optional runtime cap on the bytes used by names and values (0 = none).
+size_t mem_budget = 0;
+size_t mem_bytes = 0;
 
 // Helper functions
 int match(char *model, char *var) {
@@ -25,44 +34,62 @@ int match(char *model, char *var) {
 // Shell memory functions
 
 void mem_init(){
-    int i;
-    for (i = 0; i < VARIABLE_STORE_SIZE; i++){		
-        shellmemory[i].var   = "none";
-        shellmemory[i].value = "none";
-    }
+    mem_count = 0;
+    mem_capacity = VARIABLE_STORE_SIZE > 0 ? VARIABLE_STORE_SIZE : 1;
+    shellmemory = malloc(mem_capacity * sizeof(struct memory_struct));
+    mem_bytes = 0;
+}
+
+void mem_set_budget(size_t bytes) {
+    mem_budget = bytes;
 }
 
 // Set key value pair
-void mem_set_value(char *var_in, char *value_in) {
+// Returns 0 on success, or -1 if the value could not be stored.
+int mem_set_value(char *var_in, char *value_in) {
     int i;
+    size_t value_bytes = strlen(value_in) + 1;
 
-    for (i = 0; i < VARIABLE_STORE_SIZE; i++){
+    for (i = 0; i < mem_count; i++){
         if (strcmp(shellmemory[i].var, var_in) == 0){
+            size_t old_bytes = strlen(shellmemory[i].value) + 1;
+            if (mem_budget && mem_bytes - old_bytes + value_bytes > mem_budget) {
+                return -1;
+            }
+            free(shellmemory[i].value);
             shellmemory[i].value = strdup(value_in);
-            return;
+            mem_bytes = mem_bytes - old_bytes + value_bytes;
+            return 0;
         } 
     }
 
-    //Value does not exist, need to find a free spot.
-    for (i = 0; i < VARIABLE_STORE_SIZE; i++){
-        if (strcmp(shellmemory[i].var, "none") == 0){
-            shellmemory[i].var   = strdup(var_in);
-            shellmemory[i].value = strdup(value_in);
-            return;
-        } 
+    //Value does not exist, need to add it.
+    size_t var_bytes = strlen(var_in) + 1;
+    if (mem_budget && mem_bytes + var_bytes + value_bytes > mem_budget) {
+        return -1;
     }
-
-    return;
+    if (mem_count == mem_capacity) {
+        struct memory_struct *grown =
+            realloc(shellmemory, 2 * mem_capacity * sizeof(struct memory_struct));
+        if (!grown) return -1;
+        shellmemory = grown;
+        mem_capacity *= 2;
+    }
+    shellmemory[mem_count].var   = strdup(var_in);
+    shellmemory[mem_count].value = strdup(value_in);
+    mem_count++;
+    mem_bytes += var_bytes + value_bytes;
+    return 0;
 }
 
 //get value based on input key
 char *mem_get_value(char *var_in) {
     int i;
 
-    for (i = 0; i < VARIABLE_STORE_SIZE; i++){
+    for (i = 0; i < mem_count; i++){
         if (strcmp(shellmemory[i].var, var_in) == 0){
             return strdup(shellmemory[i].value);
         } 
     }
     return "Variable does not exist";
-}
\ No newline at end of file
+}
@@ -7,7 +7,11 @@
 #ifndef VARIABLE_STORE_SIZE
 #define VARIABLE_STORE_SIZE 100  // Default value if not defined
 #endif
+// VARIABLE_STORE_SIZE is only the initial capacity; the store grows on demand.
+
+#include <stddef.h>
 
 void mem_init();
+void mem_set_budget(size_t bytes);
 char *mem_get_value(char *var);
-void mem_set_value(char *var, char *value);
+int mem_set_value(char *var, char *value);
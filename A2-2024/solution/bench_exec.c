@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "shell.h"
+#include "interpreter.h"
+#include "shellmemory.h"
+#include "program.h"
+#include "command.h"
+
+// Benchmark for running script lines.
+// Times the per-instruction cost of the old way, parsing each line with
+// parseInput every time it runs, against running the instructions that
+// the line was compiled to when the script was loaded.
+// Commands print to stdout, which is sent to /dev/null while timing; the
+// results go to the original stdout.
+
+#define LINES 900
+#define ROUNDS 500
+#define LOOKUPS 10000000
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void write_script(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("bench_exec");
+        exit(1);
+    }
+    for (size_t i = 0; i < LINES; ++i) {
+        // A mix of the kinds of lines scripts actually contain.
+        switch (i % 5) {
+        case 0: fprintf(f, "set var%zu value%zu\n", i % 50, i); break;
+        case 1: fprintf(f, "echo $var%zu\n", i % 50); break;
+        case 2: fprintf(f, "print var%zu\n", i % 50); break;
+        case 3: fprintf(f, "echo line%zu; echo done\n", i); break;
+        case 4: fprintf(f, "set greeting hello there general kenobi\n"); break;
+        }
+    }
+    fclose(f);
+}
+
+int main() {
+    char path[] = "/tmp/bench_execXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("bench_exec");
+        return 1;
+    }
+    close(fd);
+    write_script(path);
+
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) {
+        perror("bench_exec");
+        return 1;
+    }
+
+    mem_init();
+    struct program *program = program_open(path);
+    if (!program || program->line_count != LINES) {
+        fprintf(report, "bench_exec: failed to load %s\n", path);
+        return 1;
+    }
+
+    double start = now_ns();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < LINES; ++i) {
+            parseInput(get_line(program->line_base + i));
+        }
+    }
+    double parsed = (now_ns() - start) / ((double)ROUNDS * LINES);
+
+    start = now_ns();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < LINES; ++i) {
+            run_instruction(program, i);
+        }
+    }
+    double compiled = (now_ns() - start) / ((double)ROUNDS * LINES);
+
+    fprintf(report, "Instruction execution benchmark\n");
+    fprintf(report, "===============================\n\n");
+    fprintf(report, "%d lines x %d rounds\n", LINES, ROUNDS);
+    fprintf(report, "  parseInput every time: %8.1f ns/instruction\n", parsed);
+    fprintf(report, "  compiled at load:      %8.1f ns/instruction (%.2fx)\n",
+            compiled, parsed / compiled);
+
+    // Name lookup should cost the same for every command, including the
+    // last one in the table and names that aren't commands at all.
+    const char *names[] = {"help", "echo", "spawn", "nosuchcommand"};
+    fprintf(report, "\ncommand_lookup\n");
+    for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); ++n) {
+        volatile int sink = 0;
+        start = now_ns();
+        for (int i = 0; i < LOOKUPS; ++i) {
+            sink += command_lookup(names[n]);
+        }
+        fprintf(report, "  %-14s %6.1f ns\n", names[n],
+                (now_ns() - start) / LOOKUPS);
+    }
+
+    program_release(program);
+    unlink(path);
+    return 0;
+}
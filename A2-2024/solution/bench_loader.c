@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "shellmemory.h"
+#include "code_cache.h"
+#include "compile.h"
+#include "program.h"
+
+// Benchmark for the script loader.
+// Writes scripts of various lengths to temporary files, then times loading
+// each one with the mmap loader (program_open) and with the FILE* loader
+// (program_from_FILE), which is what files that can't be mapped use. Then
+// times loading it from the code cache (code_cache.h), which is what
+// program_open does instead when the script has been compiled before.
+// linememory normally only holds 1000 lines, so this is built with a
+// bigger MEM_SIZE; see the Makefile.
+
+#define ROUNDS 5
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t write_script(const char *path, size_t lines) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("bench_loader");
+        exit(1);
+    }
+    for (size_t i = 0; i < lines; ++i) {
+        // A mix of the kinds of lines scripts actually contain.
+        switch (i % 4) {
+        case 0: fprintf(f, "set var%zu value%zu\n", i % 100, i); break;
+        case 1: fprintf(f, "echo $var%zu\n", i % 100); break;
+        case 2: fprintf(f, "print var%zu\n", i % 100); break;
+        case 3: fprintf(f, "echo line%zu; echo done\n", i); break;
+        }
+    }
+    size_t size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+// Touch every line, so that neither loader gets away with doing
+// work lazily. (The FILE* loader keeps each line's newline, and the mmap
+// loader doesn't, so don't count it.)
+static size_t checksum(struct program *p) {
+    size_t sum = 0;
+    for (size_t i = 0; i < p->line_count; ++i) {
+        const char *line = get_line(p->line_base + i);
+        size_t length = get_line_length(p->line_base + i);
+        if (length && line[length - 1] == '\n') length--;
+        sum += length + line[0];
+    }
+    return sum;
+}
+
+static void bench(const char *path, const char *cache, size_t lines) {
+    size_t size = write_script(path, lines);
+    double best_map = 1e30, best_file = 1e30;
+    size_t sum_map = 0, sum_file = 0;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        double start = now_ns();
+        struct program *p = program_open(path);
+        if (!p || p->line_count != lines) {
+            printf("mmap loader: bad load of %s\n", path);
+            exit(1);
+        }
+        sum_map = checksum(p);
+        double t = now_ns() - start;
+        if (t < best_map) best_map = t;
+        program_release(p);
+
+        start = now_ns();
+        p = program_from_FILE(fopen(path, "rt"));
+        if (!p || p->line_count != lines) {
+            printf("FILE loader: bad load of %s\n", path);
+            exit(1);
+        }
+        sum_file = checksum(p);
+        t = now_ns() - start;
+        if (t < best_file) best_file = t;
+        program_release(p);
+    }
+    assert_linememory_is_empty();
+
+    printf("%8zu lines, %6.1f MB: mmap %8.2f ms (%6.1f ns/line, %7.1f MB/s)"
+           "   FILE %8.2f ms (%6.1f ns/line, %7.1f MB/s)%s\n",
+           lines, size / 1e6,
+           best_map / 1e6, best_map / lines, size / best_map * 1e3,
+           best_file / 1e6, best_file / lines, size / best_file * 1e3,
+           sum_map == sum_file ? "" : "  MISMATCH");
+
+    // The first load compiles it and writes the entry; the rest map it.
+    code_cache_open(cache, (size_t)1 << 40);
+    double start = now_ns();
+    struct program *p = program_open(path);
+    double store = now_ns() - start;
+    size_t instructions = p ? p->code->instruction_count : 0;
+    if (p) program_release(p);
+    double best_cached = 1e30;
+    size_t sum_cached = 0;
+    int hit = 1;
+    for (int round = 0; round < ROUNDS; ++round) {
+        start = now_ns();
+        p = program_open(path);
+        if (!p || p->line_count != lines) {
+            printf("code cache: bad load of %s\n", path);
+            exit(1);
+        }
+        sum_cached = checksum(p);
+        double t = now_ns() - start;
+        if (t < best_cached) best_cached = t;
+        hit &= p->code->borrowed && p->code->instruction_count == instructions;
+        program_release(p);
+    }
+    code_cache_close();
+    assert_linememory_is_empty();
+    printf("%8s  first load + store %8.2f ms,  cached %8.2f ms (%6.1f ns/line)%s\n",
+           "", store / 1e6, best_cached / 1e6, best_cached / lines,
+           !hit ? "  MISSED" : sum_cached == sum_map ? "" : "  MISMATCH");
+    unlink(path);
+}
+
+int main() {
+    printf("Script loader benchmark (best of %d)\n", ROUNDS);
+    printf("===================================\n\n");
+    mem_init();
+    char path[] = "/tmp/bench_loaderXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("bench_loader");
+        return 1;
+    }
+    close(fd);
+    char cache[] = "/tmp/bench_loader_cacheXXXXXX";
+    if (!mkdtemp(cache)) {
+        perror("bench_loader");
+        return 1;
+    }
+    size_t sizes[] = {10000, 1000000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        bench(path, cache, sizes[i]);
+    }
+    char command[64];
+    snprintf(command, sizeof(command), "rm -r %s", cache);
+    system(command);
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "output.h"
+
+// Benchmark for the output layer.
+// Times printing lots of short lines (like echo does) with raw printf and
+// with output.c, from one thread and from several, and checks that every
+// byte arrived, and in order where it should be. stdout is redirected to a
+// scratch file while timing, so results go to stderr.
+
+#define LINES 2000000
+#define THREADS 4
+#define ROUNDS 3
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char line[] = "Hello from thread";
+
+static void *printf_lines(void *arg) {
+    for (size_t i = 0; i < LINES / THREADS; ++i) printf("%s\n", line);
+    return NULL;
+}
+
+static void *out_lines(void *arg) {
+    for (size_t i = 0; i < LINES / THREADS; ++i) out_line(line, sizeof(line) - 1);
+    return NULL;
+}
+
+// Threads share the instructions, like an MT process: each line is one
+// instruction, and they should come out numbered 0, 1, 2, ...
+static struct out_order *order;
+static size_t next_instr;
+
+static void *ordered_lines(void *arg) {
+    size_t instr;
+    while ((instr = __atomic_fetch_add(&next_instr, 1, __ATOMIC_RELAXED)) < LINES) {
+        out_begin_instruction(order, instr);
+        out_printf("instruction %zu\n", instr);
+        out_end_instruction();
+    }
+    return NULL;
+}
+
+enum method { PRINTF, OUT_PRINTF, OUT_LINE, PRINTF_MT, OUT_LINE_MT, ORDERED_MT };
+
+static void run(enum method method) {
+    pthread_t threads[THREADS];
+    void *(*body)(void *) = NULL;
+
+    switch (method) {
+        case PRINTF:
+            for (size_t i = 0; i < LINES; ++i) printf("%s\n", line);
+            fflush(stdout);
+            return;
+        case OUT_PRINTF:
+            for (size_t i = 0; i < LINES; ++i) out_printf("%s\n", line);
+            out_flush();
+            return;
+        case OUT_LINE:
+            for (size_t i = 0; i < LINES; ++i) out_line(line, sizeof(line) - 1);
+            out_flush();
+            return;
+        case PRINTF_MT: body = printf_lines; break;
+        case OUT_LINE_MT: body = out_lines; break;
+        case ORDERED_MT:
+            body = ordered_lines;
+            order = out_order_create(0);
+            next_instr = 0;
+            break;
+    }
+    for (int i = 0; i < THREADS; ++i) pthread_create(&threads[i], NULL, body, NULL);
+    for (int i = 0; i < THREADS; ++i) pthread_join(threads[i], NULL);
+    if (method == ORDERED_MT) out_order_free(order);
+    fflush(stdout);
+}
+
+// Returns 0 iff the scratch file holds exactly what method should print.
+static int check(FILE *scratch, enum method method) {
+    fseek(scratch, 0, SEEK_SET);
+    char buf[64];
+    size_t lines = 0;
+    while (fgets(buf, sizeof(buf), scratch)) {
+        if (method == ORDERED_MT) {
+            char expected[64];
+            snprintf(expected, sizeof(expected), "instruction %zu\n", lines);
+            if (strcmp(buf, expected)) return -1;
+        } else if (strcmp(buf, "Hello from thread\n")) {
+            return -1;
+        }
+        lines++;
+    }
+    return lines == LINES ? 0 : -1;
+}
+
+int main() {
+    fprintf(stderr, "Output benchmark (%d lines, best of %d)\n", LINES, ROUNDS);
+    fprintf(stderr, "=============================================\n\n");
+
+    // stdout goes to a scratch file. Point it there before anything is
+    // printed, so stdio fully buffers it as it would a redirected shell.
+    FILE *scratch = tmpfile();
+    if (!scratch) {
+        perror("tmpfile");
+        return 1;
+    }
+    dup2(fileno(scratch), STDOUT_FILENO);
+
+    static const struct {
+        const char *name;
+        enum method method;
+        enum out_flush_policy policy;
+    } cases[] = {
+        { "printf", PRINTF, OUT_FLUSH_BLOCK },
+        { "out_printf (block)", OUT_PRINTF, OUT_FLUSH_BLOCK },
+        { "out_line (block)", OUT_LINE, OUT_FLUSH_BLOCK },
+        { "out_line (exit)", OUT_LINE, OUT_FLUSH_EXIT },
+        { "out_line (line)", OUT_LINE, OUT_FLUSH_LINE },
+        { "printf, 4 threads", PRINTF_MT, OUT_FLUSH_BLOCK },
+        { "out_line, 4 threads", OUT_LINE_MT, OUT_FLUSH_BLOCK },
+        { "ordered, 4 threads", ORDERED_MT, OUT_FLUSH_BLOCK },
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        out_set_policy(cases[c].policy);
+        double best = 1e30;
+        for (int round = 0; round < ROUNDS; ++round) {
+            ftruncate(STDOUT_FILENO, 0);
+            lseek(STDOUT_FILENO, 0, SEEK_SET);
+            double start = now_ns();
+            run(cases[c].method);
+            double t = now_ns() - start;
+            if (t < best) best = t;
+        }
+        int ok = check(scratch, cases[c].method) == 0;
+        fprintf(stderr, "  %-22s %8.1f Mlines/s%s\n", cases[c].name,
+                LINES / best * 1e3, ok ? "" : "  WRONG OUTPUT");
+        if (!ok) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "shell.h"
+#include "interpreter.h"
+#include "shellmemory.h"
+
+// Benchmark for round-robin time slices.
+// Runs the same workloads through exec with RR at a range of quanta (and
+// with FCFS, which is RR with an endless one, and MLFQ, whose quantum
+// grows as processes use it up), and reports what the
+// scheduler saw: the mean turnaround time of the processes, in steps, and
+// how much of that they spent waiting; how many times it switched
+// processes; and the wall-clock cost per step, which includes the cost of
+// those switches.
+// Commands print to stdout, which is sent to /dev/null while timing; the
+// results go to the original stdout.
+
+#define ROUNDS 20
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void write_script(const char *path, size_t lines) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("bench_quantum");
+        exit(1);
+    }
+    for (size_t i = 0; i < lines; ++i) {
+        if (i % 2) fprintf(f, "set var%zu value%zu\n", i % 20, i);
+        else fprintf(f, "echo line%zu\n", i);
+    }
+    fclose(f);
+}
+
+struct workload {
+    const char *name;
+    // Three processes (exec takes at most three), in exec order.
+    size_t lines[3];
+};
+
+static const struct workload workloads[] = {
+    // A long job ahead of short ones: FCFS's worst case.
+    { "long, medium, short", { 600, 60, 6 } },
+    // Equal jobs: time slicing only delays everyone's finish.
+    { "three equal", { 200, 200, 200 } },
+};
+
+static const char *quanta[] = {
+    "RR:1", "RR:2", "RR:4", "RR:8", "RR:16", "RR:32", "RR:64", "RR:128",
+    "FCFS", "MLFQ:1", "MLFQ", "MLFQ:4",
+};
+
+int main() {
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) {
+        perror("bench_quantum");
+        return 1;
+    }
+    mem_init();
+
+    fprintf(report, "Round-robin quantum sweep\n");
+    fprintf(report, "=========================\n");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w) {
+        const struct workload *wl = &workloads[w];
+        char paths[3][32];
+        for (int i = 0; i < 3; ++i) {
+            snprintf(paths[i], sizeof(paths[i]), "/tmp/bench_quantumXXXXXX");
+            int fd = mkstemp(paths[i]);
+            if (fd < 0) {
+                perror("bench_quantum");
+                return 1;
+            }
+            close(fd);
+            write_script(paths[i], wl->lines[i]);
+        }
+
+        fprintf(report, "\n%s (%zu, %zu and %zu lines)\n", wl->name,
+                wl->lines[0], wl->lines[1], wl->lines[2]);
+        fprintf(report, "  %-8s %11s %9s %9s %9s\n", "policy", "turnaround",
+                "wait", "switches", "ns/step");
+        for (size_t q = 0; q < sizeof(quanta) / sizeof(quanta[0]); ++q) {
+            char command[256];
+            snprintf(command, sizeof(command), "exec %s %s %s %s",
+                     paths[0], paths[1], paths[2], quanta[q]);
+
+            // Every round schedules the same way, so the counts are just
+            // ROUNDS times one round's.
+            memset(&schedule_stats, 0, sizeof(schedule_stats));
+            double start = now_ns();
+            for (int round = 0; round < ROUNDS; ++round) {
+                parseInput(command);
+            }
+            double ns = (now_ns() - start) / schedule_stats.steps;
+
+            double turnaround = (double)schedule_stats.turnaround
+                              / schedule_stats.finished;
+            double length = (wl->lines[0] + wl->lines[1] + wl->lines[2]) / 3.0;
+            fprintf(report, "  %-8s %11.1f %9.1f %9zu %9.1f\n", quanta[q],
+                    turnaround, turnaround - length,
+                    schedule_stats.switches / ROUNDS, ns);
+        }
+        for (int i = 0; i < 3; ++i) unlink(paths[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pcb.h"
+#include "queue.h"
+
+// Benchmark for the ready queues.
+// Simulates a scheduler with 10 to 100k processes of random lengths on
+// each policy: dequeue a process, run it for its time slice, and put it
+// back if it isn't finished (now and then at the head, like a parent
+// resumed after a nested exec). Reports the cost of one such step with
+// the policy's queue, and with the singly linked list every policy used
+// to share, which is kept here as a reference. Both must dequeue the
+// processes in exactly the same order; we check that too.
+
+#define MAX_STEPS 200000
+// The list costs O(n) per step, so for it we only do this much work.
+#define WORK_BUDGET 50000000
+// Past this, the list is too slow to bother with.
+#define MAX_LIST_PCBS 10000
+#define MAX_LINES 200
+
+// free_queue frees the PCBs still on a queue. Ours all live in one array,
+// which is freed separately.
+void free_pcb(struct PCB *pcb) {
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The old queue, for reference: a list through a next pointer, which the
+// PCB no longer has, so these PCBs are wrapped.
+struct node {
+    struct PCB pcb;
+    struct node *next;
+};
+
+struct list {
+    struct node *head;
+    int aging;
+    size_t rate, floor;
+};
+
+static void list_push_front(struct list *l, struct node *n) {
+    n->next = l->head;
+    l->head = n;
+}
+
+static void list_push_back(struct list *l, struct node *n) {
+    struct node **p = &l->head;
+    while (*p) p = &(*p)->next;
+    n->next = NULL;
+    *p = n;
+}
+
+static void list_push_sorted(struct list *l, struct node *n) {
+    if (l->aging && n->pcb.duration < l->floor) n->pcb.duration = l->floor;
+    if (l->aging && l->head && l->head->pcb.duration == n->pcb.duration
+        && n->pcb.pc) {
+        list_push_front(l, n);
+        return;
+    }
+    struct node **p = &l->head;
+    while (*p && (*p)->pcb.duration <= n->pcb.duration) p = &(*p)->next;
+    n->next = *p;
+    *p = n;
+}
+
+static struct node *list_pop(struct list *l) {
+    struct node *n = l->head;
+    if (!n) return NULL;
+    l->head = n->next;
+    if (l->aging) {
+        for (struct node *p = l->head; p; p = p->next) {
+            if (p->pcb.duration > l->floor + l->rate) p->pcb.duration -= l->rate;
+            else p->pcb.duration = l->floor;
+        }
+    }
+    return n;
+}
+
+struct policy {
+    const char *name;
+    size_t slice; // 0 runs to completion
+    struct queue *(*alloc)(void);
+    void (*enqueue)(struct queue *, struct PCB *);
+    void (*enqueue_front)(struct queue *, struct PCB *);
+    struct PCB *(*dequeue)(struct queue *);
+    int sorted, aging;
+    size_t rate, floor;
+};
+
+// As in schedule_policy.c.
+static const struct policy policies[] = {
+    { "FCFS",  0, alloc_deque, enqueue_fcfs, enqueue_ignoring_priority,
+      dequeue_typical, 0, 0 },
+    { "RR",    2, alloc_deque, enqueue_fcfs, enqueue_ignoring_priority,
+      dequeue_typical, 0, 0 },
+    { "SJF",   0, alloc_heap, enqueue_sjf, enqueue_ignoring_priority_heap,
+      dequeue_sjf, 1, 0 },
+    { "AGING", 1, alloc_heap, enqueue_aging, enqueue_ignoring_priority_heap,
+      dequeue_aging, 1, 1, 1, 0 },
+    // As with mysh --aging-rate 2 --aging-floor 5.
+    { "AGE2/5", 1, alloc_heap, enqueue_aging, enqueue_ignoring_priority_heap,
+      dequeue_aging, 1, 1, 2, 5 },
+};
+
+static struct node *make_nodes(size_t n) {
+    struct node *nodes = calloc(n, sizeof(struct node));
+    unsigned seed = 42;
+    for (size_t i = 0; i < n; ++i) {
+        nodes[i].pcb.pid = i;
+        nodes[i].pcb.duration = 1 + rand_r(&seed) % MAX_LINES;
+        nodes[i].pcb.name = "";
+    }
+    return nodes;
+}
+
+// Run the simulation for at most steps steps, on the new queue (if l is
+// NULL) or the list. Records the pids in the order they were dequeued.
+// Returns the time per step, in ns, counting the time to queue them all
+// up in the first place; *done is the number of steps taken.
+static double simulate(const struct policy *p, size_t n, struct list *l,
+                       size_t steps, size_t *order, size_t *done) {
+    struct node *nodes = make_nodes(n);
+    size_t *length = malloc(n * sizeof(size_t));
+    for (size_t i = 0; i < n; ++i) length[i] = nodes[i].pcb.duration;
+    struct queue *q = NULL;
+    if (!l) {
+        q = p->alloc();
+        set_aging(q, p->rate, p->floor);
+    }
+
+    double start = now_ns();
+    for (size_t i = 1; i < n; ++i) {
+        if (!l) p->enqueue(q, &nodes[i].pcb);
+        else if (p->sorted) list_push_sorted(l, &nodes[i]);
+        else list_push_back(l, &nodes[i]);
+    }
+    // The first one goes in last, at the head, like the background shell
+    // input. (Things only ever go in at the head just before a dequeue.)
+    if (l) list_push_front(l, &nodes[0]);
+    else p->enqueue_front(q, &nodes[0].pcb);
+
+    unsigned seed = 7;
+    size_t step = 0;
+    for ( ; step < steps; ++step) {
+        struct PCB *pcb = l ? (struct PCB *)list_pop(l) : p->dequeue(q);
+        if (!pcb) break;
+        order[step] = pcb->pid;
+        size_t left = length[pcb->pid] - pcb->pc;
+        pcb->pc += p->slice && p->slice < left ? p->slice : left;
+        if (pcb->pc == length[pcb->pid]) continue;
+        int front = rand_r(&seed) % 16 == 0;
+        if (!l) {
+            if (front) p->enqueue_front(q, pcb);
+            else p->enqueue(q, pcb);
+        } else {
+            struct node *node = (struct node *)pcb;
+            if (front) list_push_front(l, node);
+            else if (p->sorted) list_push_sorted(l, node);
+            else list_push_back(l, node);
+        }
+    }
+    double ns = (now_ns() - start) / (step ? step : 1);
+
+    if (q) free_queue(q);
+    free(length);
+    free(nodes);
+    *done = step;
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = { 10, 100, 1000, 10000, 100000 };
+    size_t *order = malloc(MAX_STEPS * sizeof(size_t));
+    size_t *list_order = malloc(MAX_STEPS * sizeof(size_t));
+    int failed = 0;
+
+    printf("Ready queue microbenchmark (ns per scheduling step)\n");
+    printf("===================================================\n\n");
+    printf("%8s  %-6s %10s %10s %8s\n", "PCBs", "policy", "queue", "list",
+           "speedup");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t n = sizes[s];
+        size_t linear = WORK_BUDGET / n < MAX_STEPS ? WORK_BUDGET / n : MAX_STEPS;
+        for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+            const struct policy *p = &policies[i];
+            size_t done, list_done;
+            double ns = simulate(p, n, NULL, MAX_STEPS, order, &done);
+            printf("%8zu  %-6s %10.1f", n, p->name, ns);
+            if (n > MAX_LIST_PCBS) {
+                printf("\n");
+                continue;
+            }
+            struct list l = { NULL, p->aging, p->rate, p->floor };
+            double list_ns = simulate(p, n, &l, linear, list_order, &list_done);
+            printf(" %10.1f %7.1fx\n", list_ns, list_ns / ns);
+            size_t check = done < list_done ? done : list_done;
+            if (memcmp(order, list_order, check * sizeof(size_t)) != 0) {
+                printf("  MISMATCH: %s with %zu PCBs dequeues in a different order\n",
+                       p->name, n);
+                failed = 1;
+            }
+        }
+    }
+
+    free(order);
+    free(list_order);
+    return failed;
+}
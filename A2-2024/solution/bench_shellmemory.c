@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "shellmemory.h"
+
+// Microbenchmark for the variable store.
+// For each table size, fill the store with that many variables, then time
+// lookups (hits and misses) and overwrites. If lookups are O(1), the
+// ns/op figures should stay roughly flat as the table grows.
+// Also compares the ways a running script can look a variable up: by
+// name, by name with the hash already known, and through a slot.
+
+#define LOOKUPS 1000000
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(size_t n) {
+    char var[32], value[32];
+    mem_init();
+
+    double start = now_ns();
+    for (size_t i = 0; i < n; ++i) {
+        snprintf(var, sizeof(var), "var%zu", i);
+        snprintf(value, sizeof(value), "value%zu", i);
+        mem_set_value(var, value);
+    }
+    double insert = (now_ns() - start) / n;
+
+    // Pre-generate the names so we time the store and not snprintf.
+    char (*names)[32] = malloc(LOOKUPS * sizeof(*names));
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        snprintf(names[i], 32, "var%zu", (i * 7919) % n);
+    }
+
+    start = now_ns();
+    size_t hits = 0;
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        char *v = mem_get_value(names[i]);
+        if (v) hits++;
+        free(v);
+    }
+    double lookup = (now_ns() - start) / LOOKUPS;
+
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        snprintf(names[i], 32, "missing%zu", i % n);
+    }
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        char *v = mem_get_value(names[i]);
+        if (v) hits++;
+        free(v);
+    }
+    double miss = (now_ns() - start) / LOOKUPS;
+
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        snprintf(names[i], 32, "var%zu", (i * 7919) % n);
+    }
+    start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; ++i) {
+        mem_set_value(names[i], "overwritten");
+    }
+    double overwrite = (now_ns() - start) / LOOKUPS;
+
+    // Delete half, then make sure lookups of the rest still work.
+    for (size_t i = 0; i < n; i += 2) {
+        snprintf(var, sizeof(var), "var%zu", i);
+        mem_unset_value(var);
+    }
+
+    printf("%8zu vars: insert %6.1f ns  hit %6.1f ns  miss %6.1f ns  "
+           "overwrite %6.1f ns  (%zu hits, %zu left after unset)\n",
+           n, insert, lookup, miss, overwrite, hits, mem_variable_count());
+    free(names);
+}
+
+// Overwrite a few variables with values of very different lengths, big
+// enough to bypass the size classes and small enough to shrink into the
+// same block, then unset them, over and over. Every byte should be given
+// back: afterwards the stats must be back to zero.
+static int cycles(size_t rounds) {
+    static const size_t lengths[] = { 5000, 3000, 10, 9000, 2100, 4000 };
+    char var[32];
+    char *value = malloc(9001);
+    struct mem_stats stats;
+    mem_init();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (size_t v = 0; v < 4; ++v) {
+            snprintf(var, sizeof(var), "var%zu", v);
+            for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+                size_t len = lengths[(l + v) % (sizeof(lengths) / sizeof(lengths[0]))];
+                memset(value, 'a' + v, len);
+                value[len] = '\0';
+                mem_set_value(var, value);
+            }
+            mem_unset_value(var);
+        }
+    }
+    free(value);
+    mem_get_stats(&stats);
+    int leaked = stats.variables || stats.bytes_requested || stats.bytes_in_use;
+    printf("  after %zu rounds: %zu vars, %zu B requested, %zu B in use%s\n",
+           rounds, stats.variables, stats.bytes_requested, stats.bytes_in_use,
+           leaked ? "  LEAKED" : "");
+    return leaked;
+}
+
+// Borrow n variables over and over, LOOKUPS times in all, each of the
+// three ways. Then unset half of them and reuse their entries for other
+// variables, and check that the slots notice.
+static void slots(size_t n) {
+    char var[32];
+    mem_init();
+    char (*names)[32] = malloc(n * sizeof(*names));
+    size_t *hashes = malloc(n * sizeof(size_t));
+    struct mem_slot *slot = calloc(n, sizeof(struct mem_slot));
+    for (size_t i = 0; i < n; ++i) {
+        snprintf(names[i], 32, "var%zu", i);
+        hashes[i] = mem_hash_var(names[i]);
+        mem_set_value(names[i], names[i]);
+    }
+
+    double best[3] = {1e30, 1e30, 1e30};
+    size_t found = 0;
+    for (int way = 0; way < 3; ++way) {
+        double start = now_ns();
+        for (size_t i = 0; i < LOOKUPS; ++i) {
+            size_t v = i % n;
+            struct mem_value_view view;
+            int ok = way == 0 ? mem_borrow_value(names[v], &view)
+                   : way == 1 ? mem_borrow_value_hashed(names[v], hashes[v], &view)
+                   : mem_borrow_slot(&slot[v], names[v], hashes[v], &view);
+            if (ok) {
+                found += view.value[0] == 'v';
+                mem_return_value(&view);
+            }
+        }
+        best[way] = (now_ns() - start) / LOOKUPS;
+    }
+
+    for (size_t i = 0; i < n; i += 2) mem_unset_value(names[i]);
+    for (size_t i = 0; i < n / 2; ++i) {
+        snprintf(var, sizeof(var), "other%zu", i);
+        mem_set_value(var, var);
+    }
+    size_t wrong = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct mem_value_view view;
+        int ok = mem_borrow_slot(&slot[i], names[i], hashes[i], &view);
+        if (ok != (i % 2 == 1) || (ok && strcmp(view.value, names[i]))) wrong++;
+        if (ok) mem_return_value(&view);
+    }
+
+    printf("%8zu vars: by name %6.1f ns  by hash %6.1f ns  by slot %6.1f ns"
+           "%s\n", n, best[0], best[1], best[2],
+           found == 3 * (size_t)LOOKUPS && !wrong ? "" : "  WRONG");
+    free(names);
+    free(hashes);
+    free(slot);
+}
+
+// Overwrite a fixed set of variables with values of varying length, as a
+// long-running session would, and report how memory use settles.
+static void churn(size_t n, size_t rounds) {
+    char var[32], value[256];
+    struct mem_stats stats;
+    mem_init();
+
+    double start = now_ns();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (size_t i = 0; i < n; ++i) {
+            size_t len = 1 + (i * 31 + r * 17) % (sizeof(value) - 1);
+            memset(value, 'a' + (r % 26), len);
+            value[len] = '\0';
+            snprintf(var, sizeof(var), "var%zu", i);
+            mem_set_value(var, value);
+        }
+        if (r == 0 || r + 1 == rounds) {
+            mem_get_stats(&stats);
+            printf("  after round %4zu: %zu vars, %zu B requested, %zu B in use, "
+                   "%zu B reserved in %zu slabs, fragmentation %.1f%% internal "
+                   "%.1f%% external\n",
+                   r + 1, stats.variables, stats.bytes_requested,
+                   stats.bytes_in_use, stats.bytes_reserved, stats.slab_count,
+                   100 * stats.internal_fragmentation,
+                   100 * stats.external_fragmentation);
+        }
+    }
+    printf("  %.1f ns per set\n", (now_ns() - start) / (n * rounds));
+}
+
+// Fill a store with a budget until it refuses a write.
+static void budgeted(size_t bytes) {
+    char var[32];
+    struct mem_stats stats;
+    mem_init();
+    mem_set_budget(bytes);
+    size_t n = 0;
+    for (;; ++n) {
+        snprintf(var, sizeof(var), "var%zu", n);
+        if (mem_set_value(var, "some value") != MEM_OK) break;
+    }
+    mem_get_stats(&stats);
+    printf("  refused write #%zu with %zu B of %zu B in use\n",
+           n + 1, stats.bytes_in_use, bytes);
+    mem_set_budget(0);
+}
+
+// Concurrent scaling: each thread does a 90/10 mix of reads and writes over
+// a shared pool of variables. With sharded locks, throughput should keep
+// going up as threads are added, rather than flattening out as it would
+// behind one global lock.
+#define SCALING_VARS 4096
+#define SCALING_OPS 1000000
+
+static void *scaling_worker(void *arg) {
+    size_t seed = (size_t)arg;
+    char var[32];
+    for (size_t i = 0; i < SCALING_OPS; ++i) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        snprintf(var, sizeof(var), "var%zu", (seed >> 33) % SCALING_VARS);
+        if ((seed >> 20) % 10 == 0) {
+            mem_set_value(var, "written by a worker");
+        } else {
+            struct mem_value_view view;
+            if (mem_borrow_value(var, &view)) mem_return_value(&view);
+        }
+    }
+    return NULL;
+}
+
+static void scaling(int max_threads) {
+    char var[32];
+    mem_init();
+    for (size_t i = 0; i < SCALING_VARS; ++i) {
+        snprintf(var, sizeof(var), "var%zu", i);
+        mem_set_value(var, "initial");
+    }
+
+    pthread_t threads[64];
+    double base = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double start = now_ns();
+        for (int t = 0; t < n; ++t) {
+            pthread_create(&threads[t], NULL, scaling_worker, (void *)(size_t)(t + 1));
+        }
+        for (int t = 0; t < n; ++t) {
+            pthread_join(threads[t], NULL);
+        }
+        double mops = n * (double)SCALING_OPS / ((now_ns() - start) / 1e3);
+        if (n == 1) base = mops;
+        printf("  %2d threads: %7.2f Mops/s (%.2fx)\n", n, mops, mops / base);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    printf("Variable store microbenchmark\n");
+    printf("=============================\n\n");
+    size_t sizes[] = {100, 1000, 10000, 100000, 1000000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        bench(sizes[i]);
+    }
+
+    printf("\nLookups from a running script\n");
+    slots(100);
+    slots(100000);
+
+    printf("\nBudgeted store, 1MiB budget\n");
+    budgeted(1 << 20);
+
+    printf("\nOverwrite churn, 10000 variables x 200 rounds\n");
+    churn(10000, 200);
+
+    printf("\nOverwrite/unset cycles of large values\n");
+    int failed = cycles(100);
+
+    // Thread counts go up in powers of two, to the number of CPUs by
+    // default or to the first argument if one is given.
+    long cpus = argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > 1 ? (cpus < 64 ? cpus : 64) : 1;
+    printf("\nConcurrent 90%% read / 10%% write, %d variables\n", SCALING_VARS);
+    scaling(max_threads);
+    return failed;
+}
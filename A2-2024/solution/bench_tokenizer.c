@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scan.h"
+#include "tokenizer.h"
+
+// Benchmark for the tokenizer.
+// Generates a large batch script, then times splitting every line of it
+// into words with each scanner implementation the CPU supports, and
+// reports throughput in MB/s. Every implementation must produce exactly
+// the same words; we check that too, on the script and on random strings
+// at every alignment.
+
+#define SCRIPT_BYTES (32 << 20)
+#define ROUNDS 5
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Script-like text, with the odd awkward line: runs of blanks, tabs,
+// carriage returns, chains, long words and blank lines.
+static size_t append_line(char *out, unsigned *seed) {
+    static const char *lines[] = {
+        "set var%u value%u",
+        "echo $var%u",
+        "print var%u",
+        "echo line%u;   echo done%u",
+        "set  greeting\thello  there general  kenobi %u %u\r",
+        "my_mkdir dir%u ; my_cd dir%u ;my_cd ..",
+        "",
+        "   \t  ",
+        "echo averyveryveryveryveryveryveryveryveryveryverylongword%u%u",
+        "exec prog%u prog%u RR30 # MT",
+    };
+    unsigned r = rand_r(seed);
+    return sprintf(out, lines[r % 10], r % 1000, r % 77);
+}
+
+struct script {
+    char *text;
+    size_t *lines;
+    size_t line_count;
+    size_t bytes;
+};
+
+static struct script make_script() {
+    struct script s;
+    s.text = malloc(SCRIPT_BYTES + 256);
+    s.lines = malloc(SCRIPT_BYTES / 2 * sizeof(size_t));
+    s.line_count = 0;
+    unsigned seed = 42;
+    size_t used = 0;
+    while (used < SCRIPT_BYTES) {
+        s.lines[s.line_count++] = used;
+        used += append_line(s.text + used, &seed);
+        // Lines are stored like linememory stores them: NUL-terminated.
+        s.text[used++] = '\0';
+    }
+    s.bytes = used;
+    return s;
+}
+
+// Tokenize line from start to finish, into a checksum of everything the
+// tokenizer reported.
+static size_t tokenize_line(const char *line) {
+    size_t checksum = 0, pos = 0;
+    int chained;
+    do {
+        struct token tokens[8];
+        int count = tokenize_command(line, &pos, tokens, 8, &chained);
+        checksum = checksum * 31 + count;
+        for (int i = 0; i < count && i < 8; ++i) {
+            checksum = checksum * 31 + tokens[i].offset * 7 + tokens[i].length;
+        }
+        checksum = checksum * 31 + pos;
+    } while (chained);
+    return checksum;
+}
+
+static size_t tokenize_all(const struct script *s) {
+    size_t checksum = 0;
+    for (size_t l = 0; l < s->line_count; ++l) {
+        checksum = checksum * 31 + tokenize_line(s->text + s->lines[l]);
+    }
+    return checksum;
+}
+
+// Compare an implementation with the scalar one on random strings, at
+// every alignment, including ones long enough to hit the length limit.
+static int check_scanner(const char *name) {
+    static const char alphabet[] = "ab ;\t\n\r\v\f;x$\x80\xff";
+    static char buf[4096] __attribute__((aligned(64)));
+    unsigned seed = 7;
+    for (int trial = 0; trial < 50000; ++trial) {
+        size_t start = trial % 64;
+        size_t length = rand_r(&seed) % (trial % 100 ? 150 : 2500);
+        for (size_t i = 0; i < length; ++i) {
+            // Mostly word characters and blanks, so lines go on a while.
+            unsigned r = rand_r(&seed) % 64;
+            buf[start + i] = r < 40 ? 'a' : r < 54 ? ' '
+                           : alphabet[r % (sizeof(alphabet) - 1)];
+        }
+        buf[start + length] = '\0';
+        const char *s = buf + start;
+
+        scan_use("scalar");
+        size_t expected = tokenize_line(s);
+        scan_use(name);
+        if (tokenize_line(s) != expected) {
+            printf("  %s disagrees with scalar on trial %d\n", name, trial);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main() {
+    printf("Tokenizer benchmark (best of %d)\n", ROUNDS);
+    printf("================================\n\n");
+    struct script s = make_script();
+    printf("%zu lines, %.1f MB\n\n", s.line_count, s.bytes / 1e6);
+
+    const char *names[] = {"scalar", "sse2", "avx2"};
+    size_t expected = 0;
+    for (size_t n = 0; n < sizeof(names) / sizeof(names[0]); ++n) {
+        if (scan_use(names[n])) {
+            printf("  %-6s  not supported here\n", names[n]);
+            continue;
+        }
+        if (n > 0 && check_scanner(names[n])) return 1;
+        scan_use(names[n]);
+
+        double best = 1e30;
+        size_t checksum = 0;
+        for (int round = 0; round < ROUNDS; ++round) {
+            double start = now_ns();
+            checksum = tokenize_all(&s);
+            double t = now_ns() - start;
+            if (t < best) best = t;
+        }
+        if (n == 0) expected = checksum;
+        printf("  %-6s %8.1f MB/s%s\n", names[n], s.bytes / best * 1e3,
+               checksum == expected ? "" : "  MISMATCH");
+        if (checksum != expected) return 1;
+    }
+    return 0;
+}
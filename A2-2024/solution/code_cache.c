@@ -0,0 +1,458 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h> // PATH_MAX
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "command.h"
+#include "compile.h"
+#include "shellmemory.h"
+#include "program.h"
+#include "code_cache.h"
+
+#define CACHE_MAGIC "mysh-cc"
+// Bump this whenever the format, or anything that ends up in an entry
+// (struct instruction, struct word, the command ids, the var hash), changes.
+#define CACHE_VERSION 2
+#define CACHE_SUFFIX ".code"
+// How close a script's mtime can be to when its entry was written before
+// we stop trusting it (see is_racy). Some filesystems only keep mtimes to
+// the nearest 2 seconds.
+#define RACY_NS 2000000000LL
+
+// An entry is this header, then the sections it points to, each at an
+// offset from the start of the file that's a multiple of 8:
+//   the canonical path of the script, NUL-terminated;
+//   a struct cached_line for each line;
+//   the text of the lines, each NUL-terminated;
+//   the instructions, line_start and words of its struct code, with each
+//   word's text pointer replaced by its offset into the strings;
+//   the strings;
+//   its slots, all zero (unresolved).
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint16_t instruction_size;
+    uint16_t word_size;
+    uint32_t command_count;
+    uint32_t max_args;
+
+    // The script, when it was compiled.
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t content_hash;
+    // When the entry was written.
+    int64_t written_ns;
+
+    uint64_t file_size;
+    uint64_t path_offset, path_length;
+    uint64_t lines_offset, line_count;
+    uint64_t text_offset, text_size;
+    uint64_t instructions_offset, instruction_count;
+    uint64_t line_start_offset;
+    uint64_t words_offset, word_count;
+    uint64_t strings_offset, string_size;
+    uint64_t slots_offset, slot_count;
+};
+
+struct cached_line {
+    uint32_t offset; // from the start of the file
+    uint32_t length;
+};
+
+static char *cache_dir = NULL;
+static size_t cache_max_bytes;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+#define FNV_OFFSET 14695981039346656037ULL
+
+static int64_t ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t align8(uint64_t n) {
+    return (n + 7) & ~(uint64_t)7;
+}
+
+int code_cache_open(const char *dir, size_t max_bytes) {
+    if (mkdir(dir, 0700) && errno != EEXIST) {
+        perror("code cache");
+        return -1;
+    }
+    struct stat st;
+    if (stat(dir, &st) || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "code cache: %s is not a directory\n", dir);
+        return -1;
+    }
+    cache_dir = strdup(dir);
+    if (!cache_dir) return -1;
+    cache_max_bytes = max_bytes;
+    return 0;
+}
+
+void code_cache_close(void) {
+    free(cache_dir);
+    cache_dir = NULL;
+}
+
+int code_cache_enabled(void) {
+    return cache_dir != NULL;
+}
+
+// Where the entry for the script at path goes. Stores its canonical path
+// in canonical too. Returns 0, or -1 if path can't be resolved.
+static int entry_name(const char *path, char canonical[PATH_MAX],
+                      char name[PATH_MAX]) {
+    if (!realpath(path, canonical)) return -1;
+    uint64_t hash = fnv1a(FNV_OFFSET, canonical, strlen(canonical));
+    int n = snprintf(name, PATH_MAX, "%s/%016llx" CACHE_SUFFIX, cache_dir,
+                     (unsigned long long)hash);
+    return n < PATH_MAX ? 0 : -1;
+}
+
+// Hash the contents of fd, which should be size bytes long. Returns 0, or
+// -1 if it can't be read or isn't that long.
+static int hash_contents(int fd, uint64_t size, uint64_t *hash) {
+    char buffer[65536];
+    uint64_t total = 0;
+    *hash = FNV_OFFSET;
+    for (;;) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        *hash = fnv1a(*hash, buffer, n);
+        total += n;
+    }
+    return total == size ? 0 : -1;
+}
+
+// Like git's racily clean index entries: if the script was modified within
+// a timestamp tick of when it was compiled, a later change might not have
+// changed its mtime, so the stat match can't be trusted by itself.
+static int is_racy(const struct cache_header *h) {
+    return h->mtime_ns + RACY_NS > h->written_ns;
+}
+
+static int section_ok(const struct cache_header *h, uint64_t offset,
+                      uint64_t count, size_t elem_size) {
+    return offset % 8 == 0 && offset <= h->file_size
+        && count <= (h->file_size - offset) / elem_size;
+}
+
+// Check that map (the whole entry, size bytes) is sound and is for this
+// version of the script. Relocates the words as it goes.
+static int check_entry(char *map, size_t size, const char *canonical, int fd,
+                       const struct stat *st) {
+    struct cache_header *h = (struct cache_header *)map;
+    if (size < sizeof(*h) || memcmp(h->magic, CACHE_MAGIC, 8)
+        || h->version != CACHE_VERSION
+        || h->instruction_size != sizeof(struct instruction)
+        || h->word_size != sizeof(struct word)
+        || h->command_count != COMMAND_COUNT
+        || h->max_args != MAX_ARGS_SIZE
+        || h->file_size != size) {
+        return -1;
+    }
+    if (h->dev != (uint64_t)st->st_dev || h->ino != (uint64_t)st->st_ino
+        || h->size != (uint64_t)st->st_size
+        || h->mtime_ns != ns(st->st_mtim)) {
+        return -1;
+    }
+    if (!section_ok(h, h->path_offset, h->path_length + 1, 1)
+        || !section_ok(h, h->lines_offset, h->line_count, sizeof(struct cached_line))
+        || !section_ok(h, h->text_offset, h->text_size, 1)
+        || !section_ok(h, h->instructions_offset, h->instruction_count,
+                       sizeof(struct instruction))
+        || !section_ok(h, h->line_start_offset, h->line_count, sizeof(uint32_t))
+        || !section_ok(h, h->words_offset, h->word_count, sizeof(struct word))
+        || !section_ok(h, h->strings_offset, h->string_size, 1)
+        || !section_ok(h, h->slots_offset, h->slot_count, sizeof(struct mem_slot))) {
+        return -1;
+    }
+    // Two paths can hash the same.
+    if (strlen(canonical) != h->path_length
+        || memcmp(map + h->path_offset, canonical, h->path_length + 1)) {
+        return -1;
+    }
+
+    struct cached_line *lines = (struct cached_line *)(map + h->lines_offset);
+    for (uint64_t i = 0; i < h->line_count; ++i) {
+        if (lines[i].offset < h->text_offset
+            || lines[i].offset + (uint64_t)lines[i].length
+                   >= h->text_offset + h->text_size
+            || map[lines[i].offset + lines[i].length] != '\0') {
+            return -1;
+        }
+    }
+    struct instruction *instructions =
+        (struct instruction *)(map + h->instructions_offset);
+    for (uint64_t i = 0; i < h->instruction_count; ++i) {
+        struct instruction *ins = &instructions[i];
+        uint64_t kept = ins->argc < MAX_ARGS_SIZE ? ins->argc : MAX_ARGS_SIZE;
+        if (ins->command >= COMMAND_COUNT
+            || ins->first_word + kept > h->word_count) {
+            return -1;
+        }
+    }
+    uint32_t *line_start = (uint32_t *)(map + h->line_start_offset);
+    for (uint64_t i = 0; i < h->line_count; ++i) {
+        if (line_start[i] >= h->instruction_count) return -1;
+    }
+
+    if (is_racy(h)) {
+        uint64_t hash;
+        if (hash_contents(fd, h->size, &hash) || hash != h->content_hash) {
+            return -1;
+        }
+    }
+
+    char *strings = map + h->strings_offset;
+    struct word *words = (struct word *)(map + h->words_offset);
+    for (uint64_t w = 0; w < h->word_count; ++w) {
+        uintptr_t offset = (uintptr_t)words[w].text;
+        if (offset + words[w].length >= h->string_size
+            || strings[offset + words[w].length] != '\0'
+            || words[w].slot > h->slot_count) {
+            return -1;
+        }
+        words[w].text = strings + offset;
+    }
+    return 0;
+}
+
+int code_cache_load(struct program *program, const char *path, int fd,
+                    const struct stat *st) {
+    char canonical[PATH_MAX], name[PATH_MAX];
+    if (!cache_dir || entry_name(path, canonical, name)) return -1;
+
+    int cfd = open(name, O_RDONLY | O_CLOEXEC);
+    if (cfd < 0) return -1;
+    struct stat cst;
+    if (fstat(cfd, &cst) || (size_t)cst.st_size < sizeof(struct cache_header)
+        || cst.st_size > UINT32_MAX) {
+        close(cfd);
+        return -1;
+    }
+    size_t size = cst.st_size;
+    // Private and writable, as the words get relocated in place. Only the
+    // pages they're on get copied; the rest stay shared with the page cache.
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, cfd, 0);
+    if (map == MAP_FAILED) {
+        close(cfd);
+        return -1;
+    }
+    // The entry's mtime is when it was last used, for evict.
+    futimens(cfd, NULL);
+    close(cfd);
+
+    struct cache_header *h = (struct cache_header *)map;
+    struct code *code = NULL;
+    if (check_entry(map, size, canonical, fd, st)) goto miss;
+    code = calloc(1, sizeof(struct code));
+    if (!code) goto miss;
+    code->instructions = (struct instruction *)(map + h->instructions_offset);
+    code->line_start = (uint32_t *)(map + h->line_start_offset);
+    code->words = (struct word *)(map + h->words_offset);
+    code->strings = map + h->strings_offset;
+    code->slots = h->slot_count ? (struct mem_slot *)(map + h->slots_offset) : NULL;
+    code->instruction_count = h->instruction_count;
+    code->word_count = h->word_count;
+    code->string_size = h->string_size;
+    code->slot_count = h->slot_count;
+    code->borrowed = 1;
+
+    // From here on, linememory owns the mapping.
+    if (allocate_lines(h->line_count, map, size, 1, &program->line_base)) {
+        goto miss;
+    }
+    program->line_count = h->line_count;
+    struct cached_line *lines = (struct cached_line *)(map + h->lines_offset);
+    for (size_t i = 0; i < program->line_count; ++i) {
+        set_line(program->line_base + i, lines[i].offset, lines[i].length);
+    }
+    program->code = code;
+    return 0;
+
+miss:
+    free(code);
+    munmap(map, size);
+    return -1;
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+struct entry_use {
+    char *name;
+    int64_t used_ns;
+    size_t size;
+};
+
+static int by_use(const void *a, const void *b) {
+    const struct entry_use *x = a, *y = b;
+    return (x->used_ns > y->used_ns) - (x->used_ns < y->used_ns);
+}
+
+// Delete the least recently used entries until they add up to no more than
+// cache_max_bytes, sparing keep (the one just written). Leftover temporary
+// files from crashed stores count as entries too.
+static void evict(const char *keep) {
+    DIR *dir = opendir(cache_dir);
+    if (!dir) return;
+    struct entry_use *entries = NULL;
+    size_t count = 0, capacity = 0, total = 0;
+    struct dirent *d;
+    while ((d = readdir(dir))) {
+        if (!strstr(d->d_name, CACHE_SUFFIX)) continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW)
+            || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t capacity2 = capacity ? capacity * 2 : 64;
+            struct entry_use *entries2 = realloc(entries, capacity2 * sizeof(*entries));
+            if (!entries2) break;
+            entries = entries2;
+            capacity = capacity2;
+        }
+        entries[count].name = strdup(d->d_name);
+        if (!entries[count].name) break;
+        entries[count].used_ns = ns(st.st_mtim);
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+
+    if (total > cache_max_bytes) {
+        qsort(entries, count, sizeof(*entries), by_use);
+        for (size_t i = 0; i < count && total > cache_max_bytes; ++i) {
+            if (strcmp(entries[i].name, keep) == 0) continue;
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; ++i) free(entries[i].name);
+    free(entries);
+    closedir(dir);
+}
+
+void code_cache_store(const struct program *program, const char *path,
+                      const struct stat *st) {
+    const struct code *code = program->code;
+    // allocate_lines doesn't keep the text of an empty program, so there'd
+    // be nothing to map it into; it's quick to load anyway.
+    if (!cache_dir || !code || program->line_count == 0) return;
+    char canonical[PATH_MAX], name[PATH_MAX], temp[PATH_MAX + 32];
+    if (entry_name(path, canonical, name)) return;
+
+    // Hash the script as it is now, provided it's still what we loaded.
+    struct cache_header h = {0};
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat now;
+    if (fstat(fd, &now) || now.st_dev != st->st_dev || now.st_ino != st->st_ino
+        || now.st_size != st->st_size
+        || ns(now.st_mtim) != ns(st->st_mtim)
+        || hash_contents(fd, st->st_size, &h.content_hash)) {
+        close(fd);
+        return;
+    }
+    close(fd);
+    struct timespec written;
+    clock_gettime(CLOCK_REALTIME, &written);
+
+    memcpy(h.magic, CACHE_MAGIC, 8);
+    h.version = CACHE_VERSION;
+    h.instruction_size = sizeof(struct instruction);
+    h.word_size = sizeof(struct word);
+    h.command_count = COMMAND_COUNT;
+    h.max_args = MAX_ARGS_SIZE;
+    h.dev = st->st_dev;
+    h.ino = st->st_ino;
+    h.size = st->st_size;
+    h.mtime_ns = ns(st->st_mtim);
+    h.written_ns = ns(written);
+
+    h.line_count = program->line_count;
+    for (size_t i = 0; i < h.line_count; ++i) {
+        h.text_size += get_line_length(program->line_base + i) + 1;
+    }
+    h.path_length = strlen(canonical);
+    h.path_offset = align8(sizeof(h));
+    h.lines_offset = align8(h.path_offset + h.path_length + 1);
+    h.text_offset = h.lines_offset + h.line_count * sizeof(struct cached_line);
+    h.instructions_offset = align8(h.text_offset + h.text_size);
+    h.instruction_count = code->instruction_count;
+    h.line_start_offset = align8(h.instructions_offset
+                                 + h.instruction_count * sizeof(struct instruction));
+    h.words_offset = align8(h.line_start_offset + h.line_count * sizeof(uint32_t));
+    h.word_count = code->word_count;
+    h.strings_offset = h.words_offset + h.word_count * sizeof(struct word);
+    h.string_size = code->string_size;
+    h.slots_offset = align8(h.strings_offset + h.string_size);
+    h.slot_count = code->slot_count;
+    h.file_size = h.slots_offset + h.slot_count * sizeof(struct mem_slot);
+    if (h.file_size > UINT32_MAX) return;
+
+    char *data = calloc(1, h.file_size);
+    if (!data) return;
+    memcpy(data, &h, sizeof(h));
+    memcpy(data + h.path_offset, canonical, h.path_length + 1);
+    struct cached_line *lines = (struct cached_line *)(data + h.lines_offset);
+    uint64_t text_pos = h.text_offset;
+    for (size_t i = 0; i < h.line_count; ++i) {
+        size_t length = get_line_length(program->line_base + i);
+        memcpy(data + text_pos, get_line(program->line_base + i), length);
+        lines[i].offset = text_pos;
+        lines[i].length = length;
+        text_pos += length + 1;
+    }
+    memcpy(data + h.instructions_offset, code->instructions,
+           h.instruction_count * sizeof(struct instruction));
+    memcpy(data + h.line_start_offset, code->line_start,
+           h.line_count * sizeof(uint32_t));
+    struct word *words = (struct word *)(data + h.words_offset);
+    for (size_t w = 0; w < h.word_count; ++w) {
+        words[w] = code->words[w];
+        words[w].text = (const char *)(uintptr_t)(code->words[w].text - code->strings);
+    }
+    memcpy(data + h.strings_offset, code->strings, h.string_size);
+
+    // Write it to the side and rename it into place, so nobody ever maps a
+    // half-written entry.
+    snprintf(temp, sizeof(temp), "%s.tmp.%ld", name, (long)getpid());
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        int failed = write_all(fd, data, h.file_size);
+        failed |= close(fd);
+        if (failed || rename(temp, name)) unlink(temp);
+        else evict(strrchr(name, '/') + 1);
+    }
+    free(data);
+}
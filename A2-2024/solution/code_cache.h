@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+#include <sys/stat.h>
+
+struct program;
+
+// An on-disk cache of compiled scripts, so that exec'ing or run'ing a
+// script that hasn't changed since last time skips reading and compiling
+// it: its lines and code come straight out of one mmap of the cache entry.
+//
+// It's off unless a directory is given. Each script gets one entry, named
+// after a hash of its canonical path, and the entry is only used if the
+// script still has the same device, inode, size and mtime as when it was
+// compiled (and, if it was modified just before that, the same contents).
+// Entries are in this build's in-memory format, so they're only any good
+// to the same build of mysh on the same machine; anything else is a miss.
+// When the entries add up to more than max_bytes, the least recently used
+// ones are deleted.
+
+// Use dir, creating it if need be. Returns 0, or -1 (having said why) if
+// it can't be used.
+int code_cache_open(const char *dir, size_t max_bytes);
+// Stop using the cache (the entries stay where they are).
+void code_cache_close(void);
+int code_cache_enabled(void);
+// Load the script at path, which is open as fd and has status *st, from
+// the cache into program (an empty one). Returns 0, or -1 on a miss.
+int code_cache_load(struct program *program, const char *path, int fd,
+                    const struct stat *st);
+// Save a freshly compiled program, loaded from the script at path when it
+// had status *st. Failures are silent; it's only a cache.
+void code_cache_store(const struct program *program, const char *path,
+                      const struct stat *st);
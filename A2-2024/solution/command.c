@@ -0,0 +1,80 @@
+#include <pthread.h>
+#include <string.h>
+#include "shellmemory.h" // mem_hash_var
+#include "command.h"
+
+static const char *command_names[COMMAND_COUNT] = {
+    [CMD_HELP] = "help",
+    [CMD_QUIT] = "quit",
+    [CMD_SET] = "set",
+    [CMD_PRINT] = "print",
+    [CMD_ECHO] = "echo",
+    [CMD_MY_LS] = "my_ls",
+    [CMD_MY_MKDIR] = "my_mkdir",
+    [CMD_MY_TOUCH] = "my_touch",
+    [CMD_MY_CD] = "my_cd",
+    [CMD_RUN] = "run",
+    [CMD_EXEC] = "exec",
+    [CMD_SPAWN] = "spawn",
+};
+
+// Looking a name up used to mean comparing it with every command name in
+// turn, so the commands at the end of the list (and unknown ones) were the
+// slowest, and every new command slowed down the ones after it.
+//
+// Instead we use a perfect hash: a hash function, picked when the table is
+// built, that sends every command name to a different slot. A lookup then
+// hashes the name once and compares it with the one name in its slot,
+// however many commands there are.
+// The table is a power of two at least twice the number of commands, and
+// the hash function is FNV-1a with a seed; we just try seeds until one
+// has no collisions. With the table half empty that takes a few tries.
+#define TABLE_BITS 5
+#define TABLE_SIZE (1 << TABLE_BITS)
+_Static_assert(TABLE_SIZE >= 2 * COMMAND_COUNT, "command table too small");
+
+static unsigned char table[TABLE_SIZE]; // command ids; 0 is CMD_UNKNOWN
+static unsigned long long seed;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static size_t slot_for(const char *name, unsigned long long seed) {
+    unsigned long long h = 14695981039346656037ULL ^ seed;
+    for (; *name; ++name) {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211ULL;
+    }
+    // The high bits are the best mixed.
+    return h >> (64 - TABLE_BITS);
+}
+
+static void build_table() {
+    for (seed = 0; ; ++seed) {
+        memset(table, CMD_UNKNOWN, sizeof(table));
+        int id;
+        for (id = 1; id < COMMAND_COUNT; ++id) {
+            size_t slot = slot_for(command_names[id], seed);
+            if (table[slot] != CMD_UNKNOWN) break;
+            table[slot] = id;
+        }
+        if (id == COMMAND_COUNT) return;
+    }
+}
+
+enum command_id command_lookup(const char *name) {
+    pthread_once(&table_once, build_table);
+    int id = table[slot_for(name, seed)];
+    if (id != CMD_UNKNOWN && strcmp(command_names[id], name) == 0) return id;
+    return CMD_UNKNOWN;
+}
+
+const char *command_name(enum command_id command) {
+    return command_names[command];
+}
+
+void make_word(struct word *word, const char *text, size_t length) {
+    word->text = text;
+    word->length = length;
+    word->is_var = text[0] == '$';
+    word->slot = 0;
+    word->var_hash = word->is_var ? mem_hash_var(text + 1) : 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// The commands the shell knows. Names are resolved to these once, when a
+// line is compiled, instead of every time the line runs.
+// To add a command, add it here, give it a name in command.c, and give it
+// an entry in the dispatch table in interpreter.c.
+enum command_id {
+    CMD_UNKNOWN = 0,
+    CMD_HELP,
+    CMD_QUIT,
+    CMD_SET,
+    CMD_PRINT,
+    CMD_ECHO,
+    CMD_MY_LS,
+    CMD_MY_MKDIR,
+    CMD_MY_TOUCH,
+    CMD_MY_CD,
+    CMD_RUN,
+    CMD_EXEC,
+    CMD_SPAWN,
+    COMMAND_COUNT
+};
+
+// The most words a command can have, including the command name.
+#define MAX_ARGS_SIZE 7
+
+// A word of a command, ready to run: NUL-terminated text, and if it's a
+// $var reference, the hash of the variable name, so looking it up doesn't
+// have to hash it again. In compiled code, a $var reference also has a
+// slot (see compile.h), so it doesn't even have to be looked up again.
+struct word {
+    const char *text;
+    size_t length;
+    int is_var;
+    uint32_t slot; // 1 + index into code::slots, or 0 if it has none
+    size_t var_hash;
+};
+
+// Returns the command called name, or CMD_UNKNOWN. Takes the same time
+// for every command.
+enum command_id command_lookup(const char *name);
+const char *command_name(enum command_id command);
+// Fill in a word for the given NUL-terminated text.
+void make_word(struct word *word, const char *text, size_t length);
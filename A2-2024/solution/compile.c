@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include "shellmemory.h"
+#include "tokenizer.h"
+#include "compile.h"
+
+// Growable arrays, for while we don't yet know how big things are.
+static int grow(void **array, size_t *capacity, size_t needed, size_t elem_size) {
+    if (needed <= *capacity) return 0;
+    size_t new_capacity = *capacity ? *capacity : 16;
+    while (new_capacity < needed) new_capacity *= 2;
+    void *grown = realloc(*array, new_capacity * elem_size);
+    if (!grown) return -1;
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Give each distinct $var name among the words a slot. Returns 0, or -1 if
+// out of memory.
+static int assign_slots(struct code *code, size_t word_count) {
+    size_t vars = 0;
+    for (size_t w = 0; w < word_count; ++w) vars += code->words[w].is_var;
+    if (!vars) return 0;
+
+    // A little hash table of the first word with each name (plus one, so
+    // that 0 is empty), to find the names we've already seen.
+    size_t size = 16;
+    while (size < vars * 2) size *= 2;
+    uint32_t *first = calloc(size, sizeof(uint32_t));
+    code->slots = calloc(vars, sizeof(struct mem_slot));
+    if (!first || !code->slots) {
+        free(first);
+        return -1;
+    }
+
+    size_t count = 0;
+    for (size_t w = 0; w < word_count; ++w) {
+        struct word *word = &code->words[w];
+        if (!word->is_var) continue;
+        size_t i = word->var_hash & (size - 1);
+        while (first[i]) {
+            const struct word *seen = &code->words[first[i] - 1];
+            if (seen->var_hash == word->var_hash
+                && strcmp(seen->text, word->text) == 0) {
+                break;
+            }
+            i = (i + 1) & (size - 1);
+        }
+        if (first[i]) {
+            word->slot = code->words[first[i] - 1].slot;
+        } else {
+            first[i] = w + 1;
+            word->slot = ++count;
+        }
+    }
+    code->slot_count = count;
+    free(first);
+    return 0;
+}
+
+struct code *compile_lines(size_t line_base, size_t line_count) {
+    struct code *code = calloc(1, sizeof(struct code));
+    if (!code) return NULL;
+    code->line_start = malloc((line_count ? line_count : 1) * sizeof(uint32_t));
+    if (!code->line_start) goto fail;
+
+    size_t instruction_count = 0, instruction_capacity = 0;
+    size_t word_count = 0, word_capacity = 0;
+    size_t string_size = 0, string_capacity = 0;
+    // The strings buffer moves as it grows, so remember where each word's
+    // text starts, and point the words at it at the end.
+    size_t *text_offsets = NULL;
+    size_t text_offsets_capacity = 0;
+
+    for (size_t line = 0; line < line_count; ++line) {
+        const char *text = get_line(line_base + line);
+        code->line_start[line] = instruction_count;
+
+        size_t pos = 0;
+        int chained;
+        do {
+            struct token tokens[MAX_ARGS_SIZE];
+            int argc = tokenize_command(text, &pos, tokens, MAX_ARGS_SIZE, &chained);
+            int kept = argc < MAX_ARGS_SIZE ? argc : MAX_ARGS_SIZE;
+
+            if (grow((void **)&code->instructions, &instruction_capacity,
+                     instruction_count + 1, sizeof(struct instruction))
+                || grow((void **)&code->words, &word_capacity,
+                        word_count + kept, sizeof(struct word))
+                || grow((void **)&text_offsets, &text_offsets_capacity,
+                        word_count + kept, sizeof(size_t))) {
+                goto fail_offsets;
+            }
+
+            struct instruction *ins = &code->instructions[instruction_count++];
+            // No command has anywhere near 65535 words; anything past
+            // MAX_ARGS_SIZE just needs to be counted as too many.
+            ins->argc = argc < UINT16_MAX ? argc : UINT16_MAX;
+            ins->chained = chained;
+            ins->first_word = word_count;
+            ins->command = CMD_UNKNOWN;
+
+            for (int i = 0; i < kept; ++i) {
+                size_t length = tokens[i].length;
+                if (grow((void **)&code->strings, &string_capacity,
+                         string_size + length + 1, 1)) {
+                    goto fail_offsets;
+                }
+                memcpy(code->strings + string_size, text + tokens[i].offset, length);
+                code->strings[string_size + length] = '\0';
+                text_offsets[word_count] = string_size;
+                code->words[word_count].length = length;
+                word_count++;
+                string_size += length + 1;
+            }
+        } while (chained);
+    }
+
+    // Now the strings are where they'll stay.
+    for (size_t w = 0; w < word_count; ++w) {
+        make_word(&code->words[w], code->strings + text_offsets[w],
+                  code->words[w].length);
+    }
+    for (size_t i = 0; i < instruction_count; ++i) {
+        struct instruction *ins = &code->instructions[i];
+        if (ins->argc > 0) {
+            ins->command = command_lookup(code->words[ins->first_word].text);
+        }
+    }
+    free(text_offsets);
+    if (assign_slots(code, word_count)) goto fail;
+    code->instruction_count = instruction_count;
+    code->word_count = word_count;
+    code->string_size = string_size;
+    return code;
+
+fail_offsets:
+    free(text_offsets);
+fail:
+    free_code(code);
+    return NULL;
+}
+
+void free_code(struct code *code) {
+    if (!code) return;
+    if (!code->borrowed) {
+        free(code->instructions);
+        free(code->line_start);
+        free(code->words);
+        free(code->strings);
+        free(code->slots);
+    }
+    free(code);
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "command.h"
+#include "shellmemory.h"
+
+// Scripts are compiled once, when they're loaded, into instructions that
+// can be run without parsing anything: the command is already resolved,
+// the words are already split (and $var names already hashed), and each
+// ';' chain is already broken up. Each distinct $var name also gets a
+// slot (see mem_slot), so it's only looked up by name the first time it's
+// used.
+//
+// Each line compiles to one or more instructions, one per command in its
+// chain. Blank commands are kept, as instructions with no words, so that
+// running them reports an error just like typing them would.
+struct instruction {
+    uint8_t command;     // an enum command_id
+    uint8_t chained;     // the next instruction is the rest of this line
+    uint16_t argc;       // number of words, including the command name
+    uint32_t first_word; // where its words start in code::words
+};
+
+struct code {
+    struct instruction *instructions;
+    // Index of the first instruction of each line.
+    uint32_t *line_start;
+    // Words of all the instructions. Only the first MAX_ARGS_SIZE words
+    // of each instruction are kept; any more is an error anyway.
+    struct word *words;
+    // The words' text.
+    char *strings;
+    // One for each distinct $var name; see struct word.
+    struct mem_slot *slots;
+
+    size_t instruction_count;
+    size_t word_count;
+    size_t string_size;
+    size_t slot_count;
+    // The arrays above live in a code cache entry (see code_cache.h), which
+    // is freed with the program's text, so free_code mustn't free them.
+    int borrowed;
+};
+
+// Compile the line_count lines starting at linememory index line_base.
+// Returns NULL if out of memory.
+struct code *compile_lines(size_t line_base, size_t line_count);
+void free_code(struct code *code);
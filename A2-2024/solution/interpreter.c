@@ -16,7 +16,12 @@
 #include <sys/types.h> // pid_t
 #include <sys/wait.h> // waitpid
 
+#include "command.h"
+#include "compile.h"
+#include "interpreter.h"
+#include "output.h"
 #include "pcb.h"
+#include "program.h"
 #include "queue.h"
 #include "schedule_policy.h"
 #include "shellmemory.h"
@@ -26,66 +31,231 @@
 #define true 1
 #define false 0
 
-#define MAX_ARGS_SIZE 7
-
 // Global variables for multi-threading and background execution
 static int multithreaded = false;
 static int background = false;
-static struct queue *q = NULL;
-static const struct schedule_policy *policy = NULL;
+
+// Every exec runs its processes on a schedule of its own: a queue, and the
+// policy it was given. An exec run by a script (rather than typed, or
+// given in the background) nests: the script waits while the exec's
+// processes run, and then carries on. Running the nested schedule from
+// inside the script's exec command would nest the C stack as deep as the
+// execs go, so instead the exec pushes its schedule onto a stack and
+// blocks the script, and runSchedule's one loop always runs the innermost
+// schedule. When that's empty, it's popped and the script is resumed.
+struct schedule {
+    struct queue *q;
+    const struct schedule_policy *policy;
+    struct schedule_params params;
+    // The process that ran the exec, blocked until q is empty. NULL if the
+    // exec was typed, or ran on one of an MT process's threads.
+    struct PCB *parent;
+    struct schedule *outer;
+};
+static struct schedule *schedule = NULL;
+// The process the single-threaded run loop is running, if any.
+static struct PCB *running = NULL;
+// MT processes' threads can exec at the same time.
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct schedule_stats schedule_stats;
+// Who was given the last time slice, to count switches.
+static pid last_dispatched = 0;
 
 int badcommand() {
-    printf("Unknown Command\n");
+    out_printf("Unknown Command\n");
     return 1;
 }
 
 int badcommandTooLong() {
-    printf("Bad command: Too many tokens\n");
+    out_printf("Bad command: Too many tokens\n");
     return 2;
 }
 
 // For run command only
 int badcommandFileDoesNotExist() {
-    printf("Bad command: File not found\n");
+    out_printf("Bad command: File not found\n");
     return 3;
 }
 
 int badcommandMkdir() {
-    printf("Bad command: my_mkdir\n");
+    out_printf("Bad command: my_mkdir\n");
     return 4;
 }
 
 int badcommandCd() {
-    printf("Bad command: my_cd\n");
+    out_printf("Bad command: my_cd\n");
     return 5;
 }
 
+int badcommandOutOfMemory() {
+    out_printf("Bad command: variable memory is full\n");
+    return 6;
+}
+
 int help();
 int quit();
 int set(char *var, char *value[], int value_size);
 int print(char *var);
-int echo(char *tok);
+int echo(const struct word *tok);
 int ls();
-int my_mkdir(char *name);
+int my_mkdir(const struct word *name);
 int touch(char *path);
 int cd(char *path);
 int run(char *script);
 int my_exec(char *args[], int args_size);
 int spawn(char *argv[], int args_size);
 
-void runSchedule(struct queue *q, const struct schedule_policy *p);
+void runSchedule(void);
 int badcommandFileDoesNotExist();
 
-// Interpret commands and their arguments
-int interpreter(char *command_args[], int args_size) {
-    int i;
+// The dispatch table. Each command's handler gets its words both as plain
+// strings and as words (for commands that want their lengths), with any
+// $var references already replaced by their values, and is only called if
+// it got an acceptable number of words. Counts include the command name
+// itself.
+struct command_spec {
+    int min_args;
+    int max_args;
+    int (*handler)(char *args[], const struct word *words, int args_size);
+};
+
+static int do_help(char *args[], const struct word *words, int args_size) {
+    return help();
+}
+static int do_quit(char *args[], const struct word *words, int args_size) {
+    return quit();
+}
+static int do_set(char *args[], const struct word *words, int args_size) {
+    return set(args[1], &args[2], args_size-2);
+}
+static int do_print(char *args[], const struct word *words, int args_size) {
+    return print(args[1]);
+}
+static int do_echo(char *args[], const struct word *words, int args_size) {
+    return echo(&words[1]);
+}
+static int do_ls(char *args[], const struct word *words, int args_size) {
+    return ls();
+}
+static int do_mkdir(char *args[], const struct word *words, int args_size) {
+    return my_mkdir(&words[1]);
+}
+static int do_touch(char *args[], const struct word *words, int args_size) {
+    return touch(args[1]);
+}
+static int do_cd(char *args[], const struct word *words, int args_size) {
+    return cd(args[1]);
+}
+static int do_run(char *args[], const struct word *words, int args_size) {
+    return run(args[1]);
+}
+static int do_exec(char *args[], const struct word *words, int args_size) {
+    return my_exec(&args[1], args_size - 1);
+}
+static int do_spawn(char *args[], const struct word *words, int args_size) {
+    return spawn(args+1, args_size-1);
+}
 
+static const struct command_spec commands[COMMAND_COUNT] = {
+    [CMD_UNKNOWN]  = { MAX_ARGS_SIZE + 1, 0, NULL },
+    [CMD_HELP]     = { 1, 1, do_help },
+    [CMD_QUIT]     = { 1, 1, do_quit },
+    [CMD_SET]      = { 3, 7, do_set },
+    [CMD_PRINT]    = { 2, 2, do_print },
+    [CMD_ECHO]     = { 2, 2, do_echo },
+    [CMD_MY_LS]    = { 1, 1, do_ls },
+    [CMD_MY_MKDIR] = { 2, 2, do_mkdir },
+    [CMD_MY_TOUCH] = { 2, 2, do_touch },
+    [CMD_MY_CD]    = { 2, 2, do_cd },
+    [CMD_RUN]      = { 2, 2, do_run },
+    [CMD_EXEC]     = { 2, MAX_ARGS_SIZE, do_exec },
+    [CMD_SPAWN]    = { 2, MAX_ARGS_SIZE, do_spawn },
+};
+
+// Where expand_vars copies variables' values to.
+struct expansion {
+    char *text; // small, unless they didn't fit
+    size_t used;
+    size_t size;
+    char small[1024];
+};
+
+// Replace each $var word after the command name with the value of the
+// variable, or the empty string if it isn't set, so that every command
+// takes $var in any argument. The values are copied rather than borrowed,
+// as the command might set variables itself. Words with a slot (compiled
+// ones) are looked up through it.
+// Returns the words to run: words itself if there was nothing to expand,
+// otherwise expanded. Returns NULL if out of memory.
+static const struct word *expand_vars(const struct word *words, int count,
+                                      struct mem_slot *slots,
+                                      struct word expanded[],
+                                      struct expansion *x) {
+    x->text = x->small;
+    x->used = 0;
+    x->size = sizeof(x->small);
+    int first = 1;
+    while (first < count && !words[first].is_var) first++;
+    if (first == count) return words;
+
+    size_t offsets[MAX_ARGS_SIZE];
+    memcpy(expanded, words, count * sizeof(struct word));
+    for (int i = first; i < count; ++i) {
+        if (!words[i].is_var) continue;
+        struct mem_value_view value;
+        const char *name = words[i].text + 1;
+        int found = slots && words[i].slot
+            ? mem_borrow_slot(&slots[words[i].slot - 1], name,
+                              words[i].var_hash, &value)
+            : mem_borrow_value_hashed(name, words[i].var_hash, &value);
+        size_t length = found ? value.length : 0;
+
+        if (x->used + length + 1 > x->size) {
+            size_t size2 = x->size * 2;
+            if (size2 < x->used + length + 1) size2 = x->used + length + 1;
+            char *text2 = x->text == x->small ? malloc(size2)
+                                              : realloc(x->text, size2);
+            if (!text2) {
+                if (found) mem_return_value(&value);
+                if (x->text != x->small) free(x->text);
+                x->text = x->small;
+                return NULL;
+            }
+            if (x->text == x->small) memcpy(text2, x->small, x->used);
+            x->text = text2;
+            x->size = size2;
+        }
+        if (found) {
+            memcpy(x->text + x->used, value.value, length);
+            mem_return_value(&value);
+        }
+        x->text[x->used + length] = '\0';
+        offsets[i] = x->used;
+        x->used += length + 1;
+        expanded[i].length = length;
+        expanded[i].is_var = false;
+        expanded[i].slot = 0;
+        expanded[i].var_hash = 0;
+    }
+    // Only now has the text stopped moving.
+    for (int i = first; i < count; ++i) {
+        if (words[i].is_var) expanded[i].text = x->text + offsets[i];
+    }
+    return expanded;
+}
+
+// Run a command, given its already-split words. This is where both typed
+// input (via interpreter) and compiled scripts (via run_instruction) end up.
+// slots are the slots of the code the words are from, if they're compiled.
+int run_command(enum command_id command, const struct word *words, int args_size,
+                struct mem_slot *slots) {
     // these bits of debug output were very helpful for debugging
     // the changes we made to the parser!
     debug("#args: %d\n", args_size);
 #ifndef NDEBUG
-    for (size_t i = 0; i < args_size; ++i) {
-        debug("  %ld: %s\n", i, command_args[i]);
+    for (size_t i = 0; i < args_size && i < MAX_ARGS_SIZE; ++i) {
+        debug("  %ld: %s\n", i, words[i].text);
     }
 #endif
 
@@ -99,63 +269,46 @@ int interpreter(char *command_args[], int args_size) {
         return badcommandTooLong();
     }
 
-    for (i = 0; i < args_size; i++) { // terminate args at newlines
-        command_args[i][strcspn(command_args[i], "\r\n")] = 0;
+    // Unknown commands have no handler, and no valid argument counts.
+    const struct command_spec *spec = &commands[command];
+    if (args_size < spec->min_args || args_size > spec->max_args) {
+        return badcommand();
     }
 
-    if (strcmp(command_args[0], "help") == 0){
-        //help
-        if (args_size != 1) return badcommand();
-        return help();
-    
-    } else if (strcmp(command_args[0], "quit") == 0) {
-        //quit
-        if (args_size != 1) return badcommand();
-        return quit();
-
-    } else if (strcmp(command_args[0], "set") == 0) {
-        //set
-        if (args_size < 3) return badcommand();
-        if (args_size > 7) return badcommand();	
-        return set(command_args[1], &command_args[2], args_size-2);
-    
-    } else if (strcmp(command_args[0], "print") == 0) {
-        if (args_size != 2) return badcommand();
-        return print(command_args[1]);
-
-    } else if (strcmp(command_args[0], "echo") == 0) {
-        if (args_size != 2) return badcommand();
-        return echo(command_args[1]);
-
-    } else if (strcmp(command_args[0], "my_ls") == 0) {
-        if (args_size != 1) return badcommand();
-        return ls();
-
-    } else if (strcmp(command_args[0], "my_mkdir") == 0) {
-        if (args_size != 2) return badcommand();
-        return my_mkdir(command_args[1]);
+    struct word expanded[MAX_ARGS_SIZE];
+    struct expansion values;
+    words = expand_vars(words, args_size, slots, expanded, &values);
+    if (!words) return badcommandOutOfMemory();
 
-    } else if (strcmp(command_args[0], "my_touch") == 0) {
-        if (args_size != 2) return badcommand();
-        return touch(command_args[1]);
-
-    } else if (strcmp(command_args[0], "my_cd") == 0) {
-        if (args_size != 2) return badcommand();
-        return cd(command_args[1]);
-
-    } else if (strcmp(command_args[0], "run") == 0) {
-        if (args_size != 2) return badcommand();
-        return run(command_args[1]);
-    
-    } else if (strcmp(command_args[0], "exec") == 0) {
-        if (args_size < 2) return badcommand();
-        return my_exec(&command_args[1], args_size - 1);
+    // Most commands want plain strings.
+    char *args[MAX_ARGS_SIZE];
+    for (int i = 0; i < args_size; i++) {
+        args[i] = (char *)words[i].text;
+    }
+    int errorCode = spec->handler(args, words, args_size);
+    if (values.text != values.small) free(values.text);
+    return errorCode;
+}
 
-    } else if (strcmp(command_args[0], "spawn") == 0) {
-        if (args_size < 2) return badcommand();
-        return spawn(command_args+1, args_size-1);
+// Interpret commands and their arguments. The words are views, made with
+// make_word; none of them need to be freed.
+int interpreter(const struct word *words, int args_size) {
+    enum command_id command = args_size > 0 ? command_lookup(words[0].text)
+                                            : CMD_UNKNOWN;
+    return run_command(command, words, args_size, NULL);
+}
 
-    } else return badcommand();
+int run_instruction(const struct program *program, size_t n) {
+    const struct code *code = program->code;
+    const struct instruction *ins =
+        &code->instructions[code->line_start[n - program->first_line]];
+    int errorCode;
+    // Run each command in the line's chain, like parseInput would.
+    do {
+        errorCode = run_command(ins->command, &code->words[ins->first_word],
+                                ins->argc, code->slots);
+    } while ((ins++)->chained);
+    return errorCode;
 }
 
 int help() {
@@ -167,60 +320,62 @@ quit			Exits / terminates the shell with “Bye!”\n \
 set VAR STRING		Assigns a value to shell memory\n \
 print VAR		Displays the STRING assigned to VAR\n \
 run SCRIPT.TXT		Executes the file SCRIPT.TXT\n ";
-    printf("%s\n", help_string);
+    out_printf("%s\n", help_string);
     return 0;
 }
 
 int quit() {
-    printf("Bye!\n");
+    out_printf("Bye!\n");
     exit(0);
 }
 
 int set(char *var, char *value[], int value_size) {
     // precondition: value_size in [1,5]
-    char buffer[MAX_USER_INPUT];
-    char *space = " ";
+    // A $var argument can be any length once it's expanded, so size the
+    // buffer from the arguments rather than assuming MAX_USER_INPUT.
+    size_t length = value_size - 1;
+    for (size_t i = 0; i < value_size; i++) {
+        length += strlen(value[i]);
+    }
+    char *buffer = malloc(length + 1);
+    if (!buffer) return badcommandOutOfMemory();
 
-    strcpy(buffer, value[0]);
-    for (size_t i = 1; i < value_size; i++) {
-        strcat(buffer, space);
-        strcat(buffer, value[i]);
+    char *end = buffer;
+    for (size_t i = 0; i < value_size; i++) {
+        if (i) *end++ = ' ';
+        size_t n = strlen(value[i]);
+        memcpy(end, value[i], n);
+        end += n;
     }
+    *end = '\0';
 
-    mem_set_value(var, buffer);
+    // The store only refuses a write if a --var-budget is set and this
+    // would go over it. Tell the user rather than silently dropping it.
+    int result = mem_set_value(var, buffer);
+    free(buffer);
+    if (result != MEM_OK) {
+        return badcommandOutOfMemory();
+    }
 
     return 0;
 }
 
 int print(char *var) {
-    char *value = mem_get_value(var);
-    if (value) {
-        printf("%s\n", value);
-        free(value);
+    // Borrow rather than copy; we're only going to print it.
+    struct mem_value_view value;
+    if (mem_borrow_value(var, &value)) {
+        out_line(value.value, value.length);
+        mem_return_value(&value);
     } else {
-        printf("Variable does not exist\n");
+        out_printf("Variable does not exist\n");
     }
     return 0;
 }
 
-int echo(char *tok) {
-    int must_free = 0;
-    // is it a var?
-    if (tok[0] == '$') {
-        tok++; // advance pointer, so that tok is now the stuff after '$'
-        tok = mem_get_value(tok);
-        if (tok == NULL) {
-            tok = ""; // must use empty string, can't pass NULL to printf
-        } else {
-            must_free = 1;
-        }
-    }
-
-    printf("%s\n", tok);
-
-    // memory management technically optional for this assignment
-    if (must_free) free(tok);
-
+int echo(const struct word *tok) {
+    // A $var has already been replaced by its value (see expand_vars);
+    // unset variables echo as the empty string.
+    out_line(tok->text, tok->length);
     return 0;
 }
 
@@ -299,7 +454,7 @@ int ls() {
     }
 
     for (size_t i = 0; i < n; ++i) {
-        printf("%s\n", namelist[i]->d_name);
+        out_printf("%s\n", namelist[i]->d_name);
         free(namelist[i]);
     }
     free(namelist);
@@ -314,24 +469,15 @@ int str_isalphanum(char *name) {
     return 1;
 }
 
-int my_mkdir(char *name) {
-    int must_free = 0;
+int my_mkdir(const struct word *word) {
+    const char *name = word->text;
 
     debug("my_mkdir: ->%s<-\n", name);
 
-    if (name[0] == '$') {
-        ++name;
-        // lookup name
-        name = mem_get_value(name);
-        debug("  lookup: %s\n", name ? name : "(NULL)");
-        if (name) {
-            // name exists, should free whatever we got
-            must_free = 1;
-        }
-    }
-    if (!name || !str_isalphanum(name)) {
+    // A $var has already been replaced by its value (see expand_vars), or
+    // by the empty string if it doesn't exist.
+    if (!name[0] || !str_isalphanum((char *)name)) {
         // either name doesn't exist, or isn't valid, error.
-        if (must_free) free(name);
         return badcommandMkdir();
     }
     // at this point name is definitely OK
@@ -347,7 +493,6 @@ int my_mkdir(char *name) {
         perror("Something went wrong in my_mkdir");
     }
 
-    if (must_free) free(name);
     return 0;
 }
 
@@ -381,42 +526,120 @@ int cd(char *path) {
     return 0;
 }
 
-void runSchedule(struct queue *q, const struct schedule_policy *policy) {
-    if (multithreaded) {
-        // Multi-threaded execution
-        struct PCB *next_pcb = policy->dequeue(q);
-        while (next_pcb) {
-            // Run process with multiple threads (default 4 threads)
-            run_process_multithreaded(next_pcb, 4);
+// Worker threads in MT mode run their instructions exactly like the
+// single-threaded run loops below do.
+void interpret_on_thread(struct TCB *thread, size_t instr) {
+    run_instruction(thread->parent_pcb->program, instr);
+}
+
+// Done with the innermost schedule; resume whoever exec'd it.
+static void pop_schedule(void) {
+    struct schedule *s = schedule;
+    struct PCB *parent = s->parent;
+    schedule = s->outer;
+    free_queue(s->q);
+    free(s);
+    if (!parent) return;
+
+    parent->blocked = false;
+    if (parent->resume_at || parent->slice_left) {
+        // It was in the middle of a step, or a time slice; it carries on
+        // where it left off, before anything else gets a turn.
+        schedule->policy->enqueue_ignoring_priority(schedule->q, parent);
+    } else {
+        schedule->policy->enqueue(schedule->q, parent);
+    }
+}
+
+void runSchedule(void) {
+    while (schedule) {
+        struct schedule *s = schedule;
+        struct PCB *next_pcb = s->policy->dequeue(s->q);
+        if (!next_pcb) {
+            pop_schedule();
+            continue;
+        }
+
+        schedule_stats.dispatches++;
+        if (next_pcb->pid != last_dispatched) schedule_stats.switches++;
+        last_dispatched = next_pcb->pid;
+
+        if (multithreaded && !next_pcb->resume_at && !next_pcb->slice_left) {
+            // Run process with multiple threads (default 4 threads).
+            // The shell input process only has a window of its lines in
+            // memory, which threads running ahead could swap out from
+            // under one still running an earlier line; it gets one thread.
+            run_process_multithreaded(next_pcb, next_pcb->program->stream ? 1 : 4);
+            schedule_stats.finished++;
+            schedule_stats.turnaround += schedule_stats.steps - next_pcb->arrival;
             free_pcb(next_pcb);
-            next_pcb = policy->dequeue(q);
+        } else {
+            // Single-threaded execution (original behavior). A process
+            // that's part way through a nested exec finishes that
+            // single-threaded too, as threads can't pick up mid-line.
+            size_t arrival = next_pcb->arrival;
+            size_t slice = s->policy->time_slice
+                         ? s->policy->time_slice(&s->params, next_pcb)
+                         : s->params.quantum;
+            next_pcb = run_pcb_for_n_steps(next_pcb, slice);
+            if (!next_pcb) {
+                schedule_stats.finished++;
+                schedule_stats.turnaround += schedule_stats.steps - arrival;
+            }
+            // If it's blocked, the schedule its exec pushed holds on to it.
+            if (next_pcb && !next_pcb->blocked) s->policy->enqueue(s->q, next_pcb);
         }
+    }
+}
+
+// Run one step of pcb: its next line, or the rest of the line it was
+// blocked on. Stops early if a command (a nested exec) blocks it.
+static void run_step(struct PCB *pcb) {
+    const struct program *program = pcb->program;
+    const struct code *code = program->code;
+    const struct instruction *ins;
+    schedule_stats.steps++;
+    if (pcb->resume_at) {
+        ins = &code->instructions[pcb->resume_at];
+        pcb->resume_at = 0;
     } else {
-        // Single-threaded execution (original behavior)
-        struct PCB *next_pcb = policy->dequeue(q);
-        while (next_pcb) {
-            next_pcb = policy->run_pcb(next_pcb);
-            if (next_pcb) policy->enqueue(q, next_pcb);
-            next_pcb = policy->dequeue(q);
+        size_t n = pcb_next_instruction(pcb);
+        ins = &code->instructions[code->line_start[n - program->first_line]];
+    }
+    // Like run_instruction, but it can stop between commands.
+    do {
+        run_command(ins->command, &code->words[ins->first_word], ins->argc,
+                    code->slots);
+        if (pcb->blocked) {
+            if (ins->chained) pcb->resume_at = ins + 1 - code->instructions;
+            return;
         }
-    }
+    } while ((ins++)->chained);
 }
 
 struct PCB *run_pcb_to_completion(struct PCB *pcb) {
-    while (pcb_has_next_instruction(pcb)) {
-        size_t instr = pcb_next_instruction(pcb);
-        parseInput(get_line(instr));
-    }
-    free_pcb(pcb);
-    return NULL;
+    return run_pcb_for_n_steps(pcb, SIZE_MAX);
 }
 
 struct PCB *run_pcb_for_n_steps(struct PCB *pcb, size_t n) {
     debug("run n steps: n is %ld\n", n);
-    for (; n && pcb_has_next_instruction(pcb); --n) {
-        parseInput(get_line(pcb_next_instruction(pcb)));
-    }
+    running = pcb;
+    if (pcb->resume_at || pcb->slice_left) {
+        // Back from a nested exec. The rest of its line belongs to the
+        // step it was blocked in, then it gets the rest of its slice.
+        if (pcb->resume_at) run_step(pcb);
+        n = pcb->slice_left;
+        pcb->slice_left = 0;
+    }
+    for (; n && !pcb->blocked && pcb_has_next_instruction(pcb); --n) {
+        run_step(pcb);
+    }
+    running = NULL;
     debug("run n steps: looped to %ld\n", n);
+    if (pcb->blocked) {
+        pcb->slice_left = n;
+        return pcb;
+    }
     // The loop runs until either we've done n steps or the pcb is out of
     // instructions,  whichever happens first. But they might also happen
     // at the same time, in which case we should still clean up.
@@ -437,14 +660,14 @@ int run(char *script) {
 // These are all global variables because they are not local to any particular
 // call to exec. Once we go into background or into MT mode,
 // the behavior of future calls is affected.
-// Those calls also need to be able to see the existing queue.
+// Those calls also need to be able to see the existing schedules.
 // They could be defined `static` inside my_exec as well, but defining them
 // outside allows the possibility for other functions to also care about
 // the multithreaded/background state. For example, the `quit` function cares
 // about the multithreaded state.
 // Despite the top-level availability of these variables, global state is
-// rather confusing to work with. So functions like runSchedule() above
-// still take these values as arguments so they're easier to track.
+// rather confusing to work with. So only runSchedule() and my_exec() touch
+// the schedule stack.
 
 int my_exec(char *args[], int args_size) {
     // Two inputs is the minimum. This should be checked above, but sanity:
@@ -478,7 +701,8 @@ int my_exec(char *args[], int args_size) {
         // Initialize multithreaded mode
         if (!multithreaded) {
             multithreaded = true;
-            printf("Multi-threading enabled\n");
+            set_thread_executor(interpret_on_thread);
+            out_printf("Multi-threading enabled\n");
         }
         // "remove" MT from the arguments by decrementing args size.
         args_size--;
@@ -503,109 +727,129 @@ int my_exec(char *args[], int args_size) {
     args_size--;
     // Now the args,args_size array describes exactly the filenames.
     // We know the policy name now, so retrieve the actual policy.
-    policy = get_policy(policy_name);
+    struct schedule_params params;
+    const struct schedule_policy *policy = get_policy(policy_name, &params);
     if (!policy) {
-        printf("Bad command: unknown scheduling policy\n");
+        out_printf("Bad command: unknown scheduling policy\n");
         return 1;
     }
 
-    if (!background_exec) {
-        // In this case, we're a top-level exec call. We might be entering
-        // background mode though. In either case, we should reset the
-        // linememory allocator.
-        reset_linememory_allocator();
-        // We also need to allocate a queue to use.
-        // We own this, so we have to be sure to free it later!
-        assert(!q);
-        q = alloc_queue();
-    } else {
-        // In this case, we're an exec call originating from the background.
-        // Ensure that a queue exists.
-        assert(q);
+    // There are three kinds of exec call:
+    //  1. top-level: typed at the shell, or in the batch script.
+    //     Nothing is running, so we start the scheduler.
+    //  2. from the background: the rest of the input is itself a process,
+    //     and its execs just add more processes to its schedule.
+    //  3. nested: a script ran exec (or run). Its processes get a schedule
+    //     of their own, and the script waits until they're done.
+    int top_level = schedule == NULL;
+    if (top_level) {
+        // Every earlier program has finished by now, so the linememory
+        // must be empty, and the process table too.
+        assert_linememory_is_empty();
+        assert(process_count() == 0);
+    }
+    if (background_exec) {
+        assert(schedule);
+        // Create a filename for each process, in order, and enqueue them.
+        // enqueue transfers ownership of the PCB to the queue, so we're
+        // not responsible for freeing these. If one fails, the ones
+        // before it still run. We are told we may handle corner cases
+        // however we like, so that's fine. They're queued by the policy
+        // the schedule is running, whose queue it is; the one named here
+        // only had to be a real one.
+        for (int n = 0; n < args_size; ++n) {
+            struct PCB *pcb = create_process(args[n]);
+            if (!pcb) {
+                out_printf("Failed to create process\n");
+                return 0;
+            }
+            pcb->arrival = schedule_stats.steps;
+            schedule->policy->enqueue(schedule->q, pcb);
+        }
+        return 0;
     }
 
-    // Create a filename for each process, in order, and enqueue them.
-    // We are allocating PCBs, but enqueue transfers ownership of the PCB
-    // to the queue, so we're not responsible for freeing these.
+    // Build the new schedule. Nothing is on the stack until it's complete,
+    // so if anything fails, we just free it: an exec with a bad file in it
+    // runs nothing.
+    struct schedule *s = malloc(sizeof(struct schedule));
+    struct queue *q = policy->alloc_queue();
+    if (!s || !q) {
+        free(s);
+        if (q) free_queue(q);
+        return badcommandOutOfMemory();
+    }
+    if (policy->ages) set_aging(q, params.aging_rate, params.aging_floor);
+    if (policy->feedback) set_feedback(q, params.levels, params.boost);
+    s->q = q;
+    s->policy = policy;
+    s->params = params;
+    s->parent = NULL;
+    // Threads of an MT process share the loaded programs with each other.
+    if (!top_level) pthread_mutex_lock(&exec_lock);
+
     for (int n = 0; n < args_size; ++n) {
-        // Two scripts have the same filename ==> error
-        // ---------------------------------------------
-        // We check if two scripts have the same filename by scanning the
-        // existing queue. We do this because we know assignment 3 is about
-        // memory management and it's likely we're being told to error in
-        // assignment 2 so that in assignment 3 we can implement memory
-        // sharing. Since it's not tested, it doesn't really matter what we do.
-        // We're going to assume that for this check, 'recursive exec'
-        // and multithreading are not involved. This guarantees that all
-        // scheduled processes are visible on the queue while we check
-        // file names. That assumption will hold for assignment 3.
-        // Obviously it doesn't hold in a real OS!
-        // Having a proper process table, rather than only a schedule,
-        // would solve that problem.
-        if (program_already_scheduled(q, args[n])) {
-            printf("Bad command: script named %s already scheduled\n", args[n]);
-            goto cleanup;
-        }
+        // The same script can be scheduled more than once. Each process
+        // gets its own pc, but they share a single copy of the script's
+        // text in linememory; see program.h.
         struct PCB *pcb = create_process(args[n]);
         if (!pcb) {
-            printf("Failed to create process\n");
+            out_printf("Failed to create process\n");
             goto cleanup;
         }
+        pcb->arrival = schedule_stats.steps;
         policy->enqueue(q, pcb);
     }
 
-    if (background && !background_exec) {
-        // In this case, background mode is enabled but we're a top-level
-        // exec call. Therefore, we're entering background mode.
+    if (background) {
+        // Background mode is enabled but we're not a background exec.
+        // Therefore, we're entering background mode.
 
         // add the rest of the input to a new program:
         struct PCB *pcb = create_process_from_FILE(stdin);
         if (!pcb) {
-            printf("Failed to create STDIN process\n");
+            out_printf("Failed to create STDIN process\n");
             goto cleanup;
         }
+        pcb->arrival = schedule_stats.steps;
         // Ensure that this is scheduled first!
         policy->enqueue_ignoring_priority(q, pcb);
     }
 
-    if (!background_exec) {
-        // We should only start the scheduler if we are a top-level exec call.
-        // If we are not top-level, it's already running!
-        runSchedule(q, policy);
-        // After the schedule completes, if we were given the # argument,
-        // the exec should never 'return'. When it's done, so is the batch
-        // mode script we are running. Therefore, if we get here without
-        // invoking quit, we should quit.
-        if (background) return quit();
-
-        // If we are a top-level exec call,
-        // we can now release the queue we allocated for scheduling.
-top_level_cleanup:
-        free_queue(q);
-        q = NULL;
-        policy = NULL;
+    s->outer = schedule;
+    schedule = s;
+    if (!top_level) {
+        // The scheduler is already running; it gets to these processes
+        // as soon as this command returns. Meanwhile the script that ran
+        // us waits. (On an MT process's thread, there's no stopping the
+        // script part way, so its other threads carry on; the new
+        // processes still run as soon as it's finished.)
+        s->parent = running;
+        if (running) running->blocked = true;
+        pthread_mutex_unlock(&exec_lock);
+        return 0;
     }
 
-background_cleanup:
+    // We should only start the scheduler if we are a top-level exec call.
+    // If we are not top-level, it's already running!
+    runSchedule();
+    // After the schedule completes, if we were given the # argument,
+    // the exec should never 'return'. When it's done, so is the batch
+    // mode script we are running. Therefore, if we get here without
+    // invoking quit, we should quit.
+    if (background) return quit();
     return 0;
 
     // This is an unfortunately common error-handling pattern in C.
     // Without try-catch-finally as a language feature, there isn't a cleaner
     // way to handle certain kinds of errors.
     // This is essentially implementing a 'finally' block that guarantees
-    // the queue allocated for top-level exec calls is freed.
-    // Note that, if this is not a top-level exec call, we will not free
-    // anything at all. That means this program might not behave as expected:
-    //   exec P1 P2 #
-    //   exec P3 P1
-    //   quit
-    // The schedule will end up containing P1, P2, _and_ P3, because the
-    // background exec will refuse to allocate a second PCB for P1 but
-    // will not de-allocate the PCB it already made for P3.
-    // We are told we may handle corner cases however we like, so that's fine.
+    // the queue we allocated (and the processes already on it) is freed.
 cleanup:
-    if (background_exec) goto background_cleanup;
-    else                 goto top_level_cleanup;
+    if (!top_level) pthread_mutex_unlock(&exec_lock);
+    free_queue(q);
+    free(s);
+    return 0;
 }
 
 int spawn(char *argv[], int args_size) {
@@ -626,6 +870,10 @@ int spawn(char *argv[], int args_size) {
     }
     args[ix] = NULL;
 
+    // Anything still buffered must come out before the child's output
+    // does, and mustn't be inherited by the child, which would print it
+    // again if it exited.
+    out_flush_all();
     pid_t pid = fork();
     if (pid == -1) {
         perror("Fork failed");
@@ -638,7 +886,8 @@ int spawn(char *argv[], int args_size) {
         execvp(file, args);
         // exec never returns, so we are only here if something went wrong.
         perror("Exec failed");
-        exit(EXIT_FAILURE);
+        // _exit, not exit: the atexit handlers belong to the parent.
+        _exit(EXIT_FAILURE);
     }
 
     return 0;
@@ -1,12 +1,41 @@
 #pragma once
-int interpreter(char *command_args[], int args_size);
+#include <stddef.h>
+
+struct program;
+struct word;
+
+// Run a command, given its words (see command.h). args_size may be more
+// than the number of words given, if there were too many to keep.
+int interpreter(const struct word *words, int args_size);
+// Run instruction n (that is, line n) of a compiled program. Line n must
+// be in memory; see program_has_line.
+// Returns the error code of the last command in the line.
+int run_instruction(const struct program *program, size_t n);
 int help();
 
 // Run the given PCB to completion, then clean it up and return NULL.
-// Suitable implementation of schedule_policy::run_pcb.
+// Both of these stop early, and return the PCB, if it runs an exec that
+// blocks it (pcb->blocked); see my_exec.
 struct PCB *run_pcb_to_completion(struct PCB *pcb);
-// Run the given PCB for the given number of steps.
+// Run the given PCB for the given number of steps (its time slice; see
+// schedule_policy::quantum).
 // If it has remaining instructions, return it.
 // Otherwise, clean it up and return NULL.
-// Partial applications of n make this suitable for schedule_policy::run_pcb.
 struct PCB *run_pcb_for_n_steps(struct PCB *pcb, size_t n);
+
+// Running totals for everything the scheduler has run, for measuring
+// policies (see bench_quantum). Time is counted in steps: lines run by the
+// single-threaded loop. MT processes are counted as finished, but their
+// lines aren't counted.
+struct schedule_stats {
+    size_t steps;
+    // How many time slices have been given out, and how many of those went
+    // to a different process than the one before.
+    size_t dispatches;
+    size_t switches;
+    // How many processes have finished, and the total of their turnaround
+    // times: the steps from their exec to their last line.
+    size_t finished;
+    size_t turnaround;
+};
+extern struct schedule_stats schedule_stats;
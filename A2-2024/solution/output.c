@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h> // writev
+#include <unistd.h>
+#include "output.h"
+
+#define OUT_BUFFER_SIZE 65536
+
+struct out_buffer {
+    char *data;
+    size_t used;
+    size_t size;
+    // Only the owning thread writes to its buffer, so this lock is almost
+    // never contended; it's there so out_flush_all can empty other
+    // threads' buffers safely.
+    pthread_mutex_t lock;
+    // Every thread's buffer is on a list, for out_flush_all.
+    struct out_buffer *prev, *next;
+};
+
+static enum out_flush_policy policy;
+static int policy_set = 0;
+static int ordered = 0;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+// Frees a thread's buffer (and capture) when the thread exits.
+static pthread_key_t buffer_key;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct out_buffer *buffers = NULL;
+static __thread struct out_buffer *mine = NULL;
+
+// While a thread is running an instruction of an ordered process, its
+// output is captured here instead.
+struct capture {
+    struct out_order *order;
+    size_t instr;
+    char *data;
+    size_t used;
+    size_t size;
+};
+static __thread struct capture capture;
+
+// Write everything, however many tries it takes. Output errors are ignored,
+// like printf's are.
+static void write_iov(struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(STDOUT_FILENO, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        for ( ; count > 0 && (size_t)n >= iov->iov_len; iov++, count--) {
+            n -= iov->iov_len;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// These take the buffer's lock held.
+static void flush_buffer(struct out_buffer *b) {
+    if (!b->used) return;
+    struct iovec iov = { b->data, b->used };
+    write_iov(&iov, 1);
+    b->used = 0;
+}
+
+static int grow(char **data, size_t *size, size_t needed) {
+    size_t size2 = *size ? *size : OUT_BUFFER_SIZE;
+    while (size2 < needed) size2 *= 2;
+    char *data2 = realloc(*data, size2);
+    if (!data2) return -1;
+    *data = data2;
+    *size = size2;
+    return 0;
+}
+
+// Add text (and a newline, if newline) to b, flushing as the policy says.
+static void append(struct out_buffer *b, const char *text, size_t length,
+                   int newline) {
+    size_t needed = b->used + length + newline;
+    if (needed > b->size
+        && !(policy == OUT_FLUSH_EXIT && grow(&b->data, &b->size, needed) == 0)) {
+        // Too big to buffer, even empty: write the buffer and the text
+        // together.
+        if (length + newline > b->size) {
+            struct iovec iov[3] = {
+                { b->data, b->used },
+                { (char *)text, length },
+                { "\n", newline },
+            };
+            write_iov(iov, 3);
+            b->used = 0;
+            return;
+        }
+        flush_buffer(b);
+    }
+    memcpy(b->data + b->used, text, length);
+    b->used += length;
+    if (newline) b->data[b->used++] = '\n';
+
+    if (policy == OUT_FLUSH_LINE && (newline || memchr(text, '\n', length))) {
+        flush_buffer(b);
+    }
+}
+
+static void free_buffer(void *arg) {
+    struct out_buffer *b = arg;
+    pthread_mutex_lock(&buffers_lock);
+    pthread_mutex_lock(&b->lock);
+    flush_buffer(b);
+    if (b->prev) b->prev->next = b->next;
+    else buffers = b->next;
+    if (b->next) b->next->prev = b->prev;
+    pthread_mutex_unlock(&b->lock);
+    pthread_mutex_unlock(&buffers_lock);
+
+    pthread_mutex_destroy(&b->lock);
+    free(b->data);
+    free(b);
+    mine = NULL;
+    free(capture.data);
+    capture.data = NULL;
+    capture.size = 0;
+}
+
+static void init(void) {
+    if (!policy_set) {
+        policy = isatty(STDOUT_FILENO) ? OUT_FLUSH_LINE : OUT_FLUSH_BLOCK;
+    }
+    pthread_key_create(&buffer_key, free_buffer);
+    // The main thread's buffer is never freed; this empties it, and any
+    // other thread's, when the shell exits.
+    atexit(out_flush_all);
+}
+
+// The calling thread's buffer, or NULL if there's no memory for one.
+static struct out_buffer *my_buffer(void) {
+    if (mine) return mine;
+    pthread_once(&init_once, init);
+
+    struct out_buffer *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    b->size = OUT_BUFFER_SIZE;
+    b->data = malloc(b->size);
+    if (!b->data) {
+        free(b);
+        return NULL;
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_mutex_lock(&buffers_lock);
+    b->next = buffers;
+    if (buffers) buffers->prev = b;
+    buffers = b;
+    pthread_mutex_unlock(&buffers_lock);
+    pthread_setspecific(buffer_key, b);
+    mine = b;
+    return b;
+}
+
+void out_set_policy(enum out_flush_policy p) {
+    policy = p;
+    policy_set = 1;
+}
+
+int out_parse_policy(const char *name, enum out_flush_policy *p) {
+    if (strcmp(name, "line") == 0) *p = OUT_FLUSH_LINE;
+    else if (strcmp(name, "block") == 0) *p = OUT_FLUSH_BLOCK;
+    else if (strcmp(name, "exit") == 0) *p = OUT_FLUSH_EXIT;
+    else return -1;
+    return 0;
+}
+
+static void emit(const char *text, size_t length, int newline) {
+    if (capture.order) {
+        size_t needed = capture.used + length + newline;
+        if (needed > capture.size
+            && grow(&capture.data, &capture.size, needed)) {
+            return; // out of memory; drop it, as we can't write it out of turn
+        }
+        memcpy(capture.data + capture.used, text, length);
+        capture.used += length;
+        if (newline) capture.data[capture.used++] = '\n';
+        return;
+    }
+
+    struct out_buffer *b = my_buffer();
+    if (!b) {
+        struct iovec iov[2] = { { (char *)text, length }, { "\n", newline } };
+        write_iov(iov, 2);
+        return;
+    }
+    pthread_mutex_lock(&b->lock);
+    append(b, text, length, newline);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void out_write(const char *text, size_t length) {
+    emit(text, length, 0);
+}
+
+void out_line(const char *text, size_t length) {
+    emit(text, length, 1);
+}
+
+int out_printf(const char *format, ...) {
+    char small[256];
+    char *text = small;
+    va_list args;
+    int length;
+
+    // Usually the text fits in the space left in our buffer, so format it
+    // straight into there.
+    struct out_buffer *b = capture.order ? NULL : my_buffer();
+    if (b) {
+        pthread_mutex_lock(&b->lock);
+        size_t space = b->size - b->used;
+        va_start(args, format);
+        length = vsnprintf(b->data + b->used, space, format, args);
+        va_end(args);
+        if (length >= 0 && (size_t)length < space) {
+            const char *start = b->data + b->used;
+            b->used += length;
+            if (policy == OUT_FLUSH_LINE && memchr(start, '\n', length)) {
+                flush_buffer(b);
+            }
+            pthread_mutex_unlock(&b->lock);
+            return length;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    va_start(args, format);
+    length = vsnprintf(small, sizeof(small), format, args);
+    va_end(args);
+    if (length < 0) return length;
+    if ((size_t)length >= sizeof(small)) {
+        text = malloc(length + 1);
+        if (!text) return -1;
+        va_start(args, format);
+        vsnprintf(text, length + 1, format, args);
+        va_end(args);
+    }
+
+    emit(text, length, 0);
+    if (text != small) free(text);
+    return length;
+}
+
+void out_flush(void) {
+    struct out_buffer *b = mine;
+    if (!b) return;
+    pthread_mutex_lock(&b->lock);
+    flush_buffer(b);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void out_flush_all(void) {
+    // Gather up the buffers and write them all with one writev.
+    struct iovec iov[64];
+    int count = 0;
+
+    pthread_mutex_lock(&buffers_lock);
+    for (struct out_buffer *b = buffers; b; b = b->next) {
+        pthread_mutex_lock(&b->lock);
+        if (b->used) {
+            if (count == 64) {
+                write_iov(iov, count);
+                count = 0;
+            }
+            iov[count].iov_base = b->data;
+            iov[count].iov_len = b->used;
+            count++;
+        }
+    }
+    write_iov(iov, count);
+    for (struct out_buffer *b = buffers; b; b = b->next) {
+        b->used = 0;
+        pthread_mutex_unlock(&b->lock);
+    }
+    pthread_mutex_unlock(&buffers_lock);
+}
+
+// Ordered output
+
+// The output of an instruction that finished before some earlier one did.
+struct held {
+    char *text; // NULL if that instruction hasn't finished
+    size_t length;
+};
+
+struct out_order {
+    pthread_mutex_t lock;
+    // The instruction whose output comes next.
+    size_t next;
+    // Output that is in order, waiting to be flushed.
+    struct out_buffer released;
+    // A ring of held output: instruction next + i's is in
+    // held[(next + i) % held_size], for i < held_size. A thread that gets
+    // descheduled mid-instruction can leave the others to run far ahead,
+    // so the ring grows as needed.
+    struct held *held;
+    size_t held_size;
+};
+
+void out_set_ordered(int on) {
+    ordered = on;
+}
+
+int out_get_ordered(void) {
+    return ordered;
+}
+
+struct out_order *out_order_create(size_t first) {
+    pthread_once(&init_once, init);
+    struct out_order *order = calloc(1, sizeof(*order));
+    if (!order) return NULL;
+    order->released.size = OUT_BUFFER_SIZE;
+    order->released.data = malloc(order->released.size);
+    if (!order->released.data) {
+        free(order);
+        return NULL;
+    }
+    pthread_mutex_init(&order->lock, NULL);
+    order->next = first;
+    return order;
+}
+
+void out_order_free(struct out_order *order) {
+    if (!order) return;
+    // Every instruction has finished, so nothing is held back any more.
+    // (Unless a copy couldn't be made, in which case the ones after it
+    // were stuck; they're dropped too.)
+    flush_buffer(&order->released);
+    for (size_t i = 0; i < order->held_size; ++i) {
+        free(order->held[i].text);
+    }
+    pthread_mutex_destroy(&order->lock);
+    free(order->released.data);
+    free(order->held);
+    free(order);
+}
+
+// Make room in the ring for the instruction distance after next.
+static int grow_held(struct out_order *order, size_t distance) {
+    size_t size2 = order->held_size ? order->held_size : 16;
+    while (size2 <= distance) size2 *= 2;
+    struct held *held2 = calloc(size2, sizeof(*held2));
+    if (!held2) return -1;
+    for (size_t i = 0; i < order->held_size; ++i) {
+        size_t instr = order->next + i;
+        held2[instr % size2] = order->held[instr % order->held_size];
+    }
+    free(order->held);
+    order->held = held2;
+    order->held_size = size2;
+    return 0;
+}
+
+void out_begin_instruction(struct out_order *order, size_t instr) {
+    // Only so that the capture gets freed with it when the thread exits.
+    my_buffer();
+    capture.order = order;
+    capture.instr = instr;
+    capture.used = 0;
+}
+
+void out_end_instruction(void) {
+    struct out_order *order = capture.order;
+    if (!order) return;
+    capture.order = NULL;
+
+    pthread_mutex_lock(&order->lock);
+    if (capture.instr != order->next) {
+        // An earlier instruction is still running. Keep a copy of this
+        // output for whichever thread finishes that one.
+        size_t distance = capture.instr - order->next;
+        if (distance >= order->held_size && grow_held(order, distance)) {
+            goto out; // out of memory; this output is lost
+        }
+        struct held *h = &order->held[capture.instr % order->held_size];
+        h->text = malloc(capture.used ? capture.used : 1);
+        if (!h->text) goto out;
+        memcpy(h->text, capture.data, capture.used);
+        h->length = capture.used;
+        goto out;
+    }
+
+    // This is next. Release it, and anything it was holding up.
+    append(&order->released, capture.data, capture.used, 0);
+    order->next++;
+    while (order->held_size) {
+        struct held *h = &order->held[order->next % order->held_size];
+        if (!h->text) break;
+        append(&order->released, h->text, h->length, 0);
+        free(h->text);
+        h->text = NULL;
+        order->next++;
+    }
+
+out:
+    pthread_mutex_unlock(&order->lock);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stddef.h>
+
+// Everything the shell prints to stdout goes through here instead of
+// stdio. Each thread collects its output in its own buffer, so threads
+// don't contend for stdout's lock on every line, and buffers are written
+// out with as few write(2)s as possible.
+
+// When buffered output is written out.
+enum out_flush_policy {
+    OUT_FLUSH_LINE,  // after every complete line, like stdio on a terminal
+    OUT_FLUSH_BLOCK, // when a buffer fills up, like stdio on a pipe or file
+    OUT_FLUSH_EXIT,  // buffers grow instead; only written out at exit
+};
+
+// The default is LINE if stdout is a terminal and BLOCK otherwise.
+// Whatever the policy, output is also flushed before the shell forks and
+// before it waits for typed input.
+void out_set_policy(enum out_flush_policy policy);
+// Parse "line", "block" or "exit". Returns 0 on success.
+int out_parse_policy(const char *name, enum out_flush_policy *policy);
+
+void out_write(const char *text, size_t length);
+// Write text followed by a newline.
+void out_line(const char *text, size_t length);
+int out_printf(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+// Write out everything the calling thread has buffered.
+void out_flush(void);
+// Write out every thread's buffer, e.g. before forking.
+void out_flush_all(void);
+
+// Deterministic ordering for multi-threaded processes.
+// Threads of one process run its instructions concurrently, so their
+// output can interleave differently every run. With ordering on, each
+// instruction's output is held back until every earlier instruction of the
+// process has finished, so it comes out exactly as if the process had run
+// on one thread.
+struct out_order;
+void out_set_ordered(int ordered);
+int out_get_ordered(void);
+// first is the number of the first instruction that will be run.
+struct out_order *out_order_create(size_t first);
+// Flushes whatever is left, and frees it.
+void out_order_free(struct out_order *order);
+// Everything the calling thread writes between these two is the output of
+// instruction instr. These don't nest.
+void out_begin_instruction(struct out_order *order, size_t instr);
+void out_end_instruction(void);
@@ -1,43 +1,111 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h> // memset
-#include "shell.h" // MAX_USER_INPUT
-#include "shellmemory.h"
+#include <string.h>
+#include "program.h"
 #include "pcb.h"
 
 int pcb_has_next_instruction(struct PCB *pcb) {
-    // have next if pc < line_count.
+    // have next if the program has a line pc. (For the shell input
+    // process, this is where more input gets read.)
     // Sanity check: count = 0  ==> never have next. Good!
-    return pcb->pc < pcb->line_count;
+    return pcb->resume_at || program_has_line(pcb->program, pcb->pc);
 }
 
 size_t pcb_next_instruction(struct PCB *pcb) {
-    size_t i = pcb->line_base + pcb->pc;
-    pcb->pc++;
-    return i;
+    return pcb->pc++;
 }
 
-struct PCB *create_process(const char *filename) {
-    // We have 2 main tasks:
-    // load all the code in the script file into shellmemory, and
-    // allocate+fill a PCB.
+// The process table. Every live PCB is in it, from when it's created until
+// it's freed, whatever it's doing in between: waiting on a queue, running,
+// blocked on a nested exec, or not yet scheduled. The pid index is an
+// open-addressed hash table. Pids are handed out in order, so a pid's own
+// low bits spread the live ones about as well as any hash would. The
+// other index is by program, which has its own table (see program.h).
+// Like the program table, this is only touched by the thread running the
+// scheduler, or by an MT worker holding the exec lock.
+static struct PCB **by_pid = NULL;
+static size_t by_pid_size = 0; // a power of two
+static size_t live = 0;
 
-    // We don't want to allocate a PCB until we know we actually need one,
-    // so let's first make sure we can open the file.
-    FILE *script = fopen(filename, "rt");
-    if (!script) {
-        perror("failed to open file for create_process");
-        return NULL;
+static void index_pid(struct PCB **table, size_t size, struct PCB *pcb) {
+    size_t i = pcb->pid & (size - 1);
+    while (table[i]) i = (i + 1) & (size - 1);
+    table[i] = pcb;
+}
+
+// Returns 0, or -1 if there's no room for it.
+static int add_process(struct PCB *pcb) {
+    // Keep the table at most half full.
+    if (2 * (live + 1) > by_pid_size) {
+        size_t size = by_pid_size ? by_pid_size * 2 : 64;
+        struct PCB **table = calloc(size, sizeof(struct PCB *));
+        if (!table) return -1;
+        for (size_t i = 0; i < by_pid_size; ++i) {
+            if (by_pid[i]) index_pid(table, size, by_pid[i]);
+        }
+        free(by_pid);
+        by_pid = table;
+        by_pid_size = size;
     }
-    struct PCB *pcb = create_process_from_FILE(script);
-    // Update the pcb name according to the filename we received.
-    pcb->name = strdup(filename);
-    return pcb;
+    index_pid(by_pid, by_pid_size, pcb);
+    live++;
+
+    struct program *program = pcb->program;
+    pcb->prev_in_program = NULL;
+    pcb->next_in_program = program->processes;
+    if (program->processes) program->processes->prev_in_program = pcb;
+    program->processes = pcb;
+    return 0;
 }
 
-struct PCB *create_process_from_FILE(FILE *script) {
-    // We can open the file, so we'll be making a process.
+static void remove_process(struct PCB *pcb) {
+    size_t mask = by_pid_size - 1;
+    size_t hole = pcb->pid & mask;
+    while (by_pid[hole] != pcb) hole = (hole + 1) & mask;
+    by_pid[hole] = NULL;
+    // Close the gap: move back anything after it that could have gone in
+    // the hole, so no lookup stops there too soon.
+    for (size_t i = (hole + 1) & mask; by_pid[i]; i = (i + 1) & mask) {
+        size_t home = by_pid[i]->pid & mask;
+        // Leave it if its home is cyclically in (hole, i].
+        if (((i - home) & mask) < ((i - hole) & mask)) continue;
+        by_pid[hole] = by_pid[i];
+        by_pid[i] = NULL;
+        hole = i;
+    }
+    live--;
+
+    if (pcb->prev_in_program) pcb->prev_in_program->next_in_program = pcb->next_in_program;
+    else pcb->program->processes = pcb->next_in_program;
+    if (pcb->next_in_program) pcb->next_in_program->prev_in_program = pcb->prev_in_program;
+}
+
+struct PCB *find_process(pid pid) {
+    if (!live) return NULL;
+    size_t mask = by_pid_size - 1;
+    for (size_t i = pid & mask; by_pid[i]; i = (i + 1) & mask) {
+        if (by_pid[i]->pid == pid) return by_pid[i];
+    }
+    return NULL;
+}
+
+size_t process_count(void) {
+    return live;
+}
+
+struct PCB *find_processes_running(const char *path) {
+    struct program *program = program_find(path);
+    return program ? program->processes : NULL;
+}
+
+// Allocate+fill a PCB to run the given program, taking over the
+// caller's reference to it.
+static struct PCB *create_process_for(struct program *program) {
     struct PCB *pcb = malloc(sizeof(struct PCB));
+    if (!pcb) {
+        program_release(program);
+        return NULL;
+    }
 
     // The PID is the only weird part. They need to be distinct,
     // so let's use a static counter.
@@ -46,61 +114,51 @@ struct PCB *create_process_from_FILE(FILE *script) {
 
     // name should be the empty string, according to doc comment.
     pcb->name = "";
-    // next should be NULL, according to doc comment.
-    pcb->next = NULL;
 
+    pcb->program = program;
     // pc is always initially 0.
     pcb->pc = 0;
+    // duration should initially match line_count. (For the shell input
+    // process, that's just the lines it has read so far.)
+    pcb->duration = program->line_count;
 
     // Initialise thread support
     pcb->thread_count = 0;
     pcb->threads = NULL;
-    pthread_mutex_init(&pcb->process_mutex, NULL);
-
-    // create initial values for base and count, in case we fail to read
-    // any lines from the file. That way we'll end up with an empty process
-    // that terminates as soon as it is scheduled -- reasonable behavior for
-    // an empty script.
-    // If we don't do this, and the loop below never runs, base would be
-    // unitialized, which would be catastrophic.
-    pcb->line_count = 0;
-    pcb->line_base = 0;
-
-    // We're told to assume lines of files are limited to 100 characters.
-    // That's all well and good, but for implementing # we need to read
-    // actual user input, and _that_ is limited to 1000 characters.
-    // It's unclear if we should assume it's also limited to 100 for this
-    // purpose. If you did assume that, that's OK! We didn't.
-    char linebuf[MAX_USER_INPUT];
-    while (!feof(script)) {
-        memset(linebuf, 0, sizeof(linebuf));
-        fgets(linebuf, MAX_USER_INPUT, script);
-
-        size_t index = allocate_line(linebuf);
-        // If we've run out of memory, clean up the partially-allocated
-        // pcb and return NULL.
-        if (index == (size_t)(-1)) {
-            free_pcb(pcb);
-            fclose(script);
-            return NULL;
-        }
-
-        if (pcb->line_count == 0) {
-            // do this on the first iteration only.
-            pcb->line_base = index;
-        }
-        pcb->line_count++;
+    pcb->output_order = NULL;
+    pcb->blocked = 0;
+    pcb->resume_at = 0;
+    pcb->slice_left = 0;
+    pcb->arrival = 0;
+    if (add_process(pcb)) {
+        program_release(program);
+        free(pcb);
+        return NULL;
     }
+    pthread_mutex_init(&pcb->process_mutex, NULL);
 
-    // We're done with the file, don't forget to close it!
-    fclose(script);
-
-    // duration should initially match line_count.
-    pcb->duration = pcb->line_count;
+    return pcb;
+}
 
+struct PCB *create_process(const char *filename) {
+    // We have 2 main tasks:
+    // find or load the code in the script file into shellmemory, and
+    // allocate+fill a PCB.
+    struct program *program = program_open(filename);
+    if (!program) return NULL;
+    struct PCB *pcb = create_process_for(program);
+    if (!pcb) return NULL;
+    // Update the pcb name according to the filename we received.
+    pcb->name = strdup(filename);
     return pcb;
 }
 
+struct PCB *create_process_from_FILE(FILE *script) {
+    struct program *program = program_from_stream(script);
+    if (!program) return NULL;
+    return create_process_for(program);
+}
+
 void free_pcb(struct PCB *pcb) {
     // Free all threads first
     struct TCB *current_thread = pcb->threads;
@@ -112,10 +170,11 @@ void free_pcb(struct PCB *pcb) {
     
     // Destroy the mutex
     pthread_mutex_destroy(&pcb->process_mutex);
+
+    remove_process(pcb);
     
-    for (size_t ix = pcb->line_base; ix < pcb->line_base + pcb->line_count; ++ix) {
-        free_line(ix);
-    }
+    // Other processes might still be running the same program.
+    program_release(pcb->program);
     // Free the process name, but only if it's not the empty string.
     // The empty name (for the shell input process) was not malloc'd.
     if (strcmp("", pcb->name)) {
@@ -148,13 +207,26 @@ void free_thread(struct TCB *thread) {
 }
 
 int tcb_has_next_instruction(struct TCB *tcb) {
-    return tcb->pc < tcb->parent_pcb->line_count;
+    return program_has_line(tcb->parent_pcb->program, tcb->pc);
 }
 
 size_t tcb_next_instruction(struct TCB *tcb) {
-    size_t i = tcb->parent_pcb->line_base + tcb->pc;
-    tcb->pc++;
-    return i;
+    return tcb->pc++;
+}
+
+int tcb_claim_instruction(struct TCB *tcb, size_t *instr) {
+    struct PCB *pcb = tcb->parent_pcb;
+    int claimed = 0;
+
+    pthread_mutex_lock(&pcb->process_mutex);
+    if (pcb_has_next_instruction(pcb)) {
+        tcb->pc = pcb->pc;
+        *instr = pcb_next_instruction(pcb);
+        claimed = 1;
+    }
+    pthread_mutex_unlock(&pcb->process_mutex);
+
+    return claimed;
 }
 
 void add_thread_to_process(struct PCB *pcb, struct TCB *thread) {
@@ -1,7 +1,10 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <pthread.h> 
+#include "output.h"
+#include "program.h"
 
 typedef size_t pid;
 typedef size_t tid; // Thread ID
@@ -20,72 +23,112 @@ struct TCB {
 // A process info struct.
 struct PCB {
     pid pid;
-    // Store the process name, which we can use to detect that multiple
-    // processes with the same name are being scheduled.
+    // Store the process name, for display and debugging.
     // We set it to the empty string if the process name is not known,
     // which should only happen when the process is the 'shell input'
     // background process.
-    // Note: on Linux, knowing the filenames is not enough to guarantee
-    // that the files are actually different.
-    // Reasons for this, e.g. `a/b` is the same file as
-    // `a/../a/b` but also so-called hardlinks. There's a way to detect
-    // if two open files have the same inode number, which is what we
-    // would want to do in a real OS.
-    // But for this purposes, just going to stick to doing comparison by name.
     char *name;
-    // Base+count form a base-bounds pair for the memory allocated
-    // to this process. Seeing it this way helps see how we can replace
-    // it with pseudo-paging
-    size_t line_base;
-    size_t line_count;
+    // The code this process runs. Processes running the same script share
+    // one program; see program.h. Its line_base+line_count form a
+    // base-bounds pair for the memory holding the code. Seeing it this way
+    // helps see how we can replace it with pseudo-paging
+    struct program *program;
 
     // This field is used for SJF and aging, and should initially have
-    // the same value as line_count.
+    // the same value as program->line_count.
     size_t duration;
 
     // pc is the number of the instruction next to execute.
     // For example, it is initially 0, regardless of the value of
-    // line_base. (like the "virtual address" of the next insn.)
+    // program->line_base. (like the "virtual address" of the next insn.)
     size_t pc;
 
     // Thread support
     int thread_count; // Number of threads in this process
     struct TCB *threads; // Linked list of threads
     pthread_mutex_t process_mutex; // Mutex for process-level synchronisation
+    // While its threads are running, keeps their output in instruction
+    // order, if ordered output is on (see output.h). NULL otherwise.
+    struct out_order *output_order;
+
+    // For nested exec (see my_exec in interpreter.c). While the processes
+    // an exec started are running, the process that ran it is blocked and
+    // off the queue. When it's resumed, it first finishes the line it was
+    // on, from instruction resume_at of its code (if that's not 0), and
+    // then has slice_left steps of its time slice left.
+    int blocked;
+    uint32_t resume_at;
+    size_t slice_left;
+
+    // schedule_stats.steps when it was exec'd, for its turnaround time;
+    // see interpreter.h.
+    size_t arrival;
 
     // The only purpose here of PCBs is to manage
     // scheduling; the multiprocessing structure simply isn't complicated
     // enough to warrant a factored-out PCB struct that can be used
     // in many different contexts. So we entangle it with the queue by just
-    // including the next pointer here directly. The alternative would be
-    // to invent a queue structure that has a pointer to a PCB,
-    // and manage it separately.
-    // If this PCB is the tail of the queue, next is NULL.
-    struct PCB *next;
+    // keeping its place in a heap queue (SJF, AGING) here directly; see
+    // queue.c. Meaningless while the PCB isn't on one. (While it's waiting
+    // on an AGING queue, so is duration: it's aged lazily.)
+    int64_t queue_key;
+    int64_t queue_seq;
+    int64_t queue_age;
+    // For an MLFQ: which level it's on (or was, while it runs), and its pc
+    // when it was last dequeued, for counting the steps it ran.
+    size_t queue_level;
+    size_t queue_pc;
+
+    // The other live processes running the same program; see
+    // program->processes.
+    struct PCB *prev_in_program;
+    struct PCB *next_in_program;
 };
 
-// Returns non-zero iff there are more instructions to execute.
+// Returns non-zero iff there are more instructions to execute (including
+// the rest of a line a nested exec interrupted).
 int pcb_has_next_instruction(struct PCB *pcb);
-// Get the shellmemory index of the next instruction, and increment pc.
+// Get the number of the next instruction, and increment pc.
+// Instructions are numbered from 0 within the process's program: line n of
+// the script is instruction n. (Not the linememory index, which can change
+// if the linememory is compacted.)
 size_t pcb_next_instruction(struct PCB *pcb);
 // Create a new process from the given filename:
 //   1. Allocates a new PCB
-//   2. Loads the code from the script file into shellmemory
-//   3. Does NOT enqueue the PCB to any scheduling queue (next is NULL)
+//   2. Loads the code from the script file into shellmemory, or shares it
+//      with processes already running the same script
+//   3. Does NOT enqueue the PCB to any scheduling queue, but does add it
+//      to the process table
 struct PCB *create_process(const char *filename);
-// Like create_process, but takes a FILE* directly.
+// Like create_process, but takes a FILE* directly, and reads it as the
+// process runs rather than all at once; see program_from_stream.
 // Ownership of the FILE* is taken and it will be closed.
 struct PCB *create_process_from_FILE(FILE *f);
 // Cleanup a process:
-//   1. Free all shellmemory used by the process code
+//   1. Free all shellmemory used by the process code, unless other
+//      processes are still running it
 //   2. Free the PCB
 void free_pcb(struct PCB *pcb);
 
+// The process table: every PCB from when it's created until free_pcb,
+// whether it's queued, running or blocked. Lookups are O(1).
+// The live process with this pid, or NULL.
+struct PCB *find_process(pid pid);
+// How many processes are live.
+size_t process_count(void);
+// The live processes running the script at path, or any other name for
+// the same file (listed through next_in_program), or NULL if there are none.
+struct PCB *find_processes_running(const char *path);
+
 // Thread management functions
 struct TCB *create_thread(struct PCB *parent);
 void free_thread(struct TCB *thread);
 int tcb_has_next_instruction(struct TCB *tcb);
 size_t tcb_next_instruction(struct TCB *tcb);
+// For threads that share their process's instructions: atomically claim the
+// process's next instruction, advancing its pc. Returns non-zero and sets
+// *instr if there was one left.
+int tcb_claim_instruction(struct TCB *tcb, size_t *instr);
 void add_thread_to_process(struct PCB *pcb, struct TCB *thread);
 void remove_thread_from_process(struct PCB *pcb, struct TCB *thread);
 
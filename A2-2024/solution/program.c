@@ -0,0 +1,387 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // memchr
+#include <unistd.h> // sysconf
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include "shell.h" // MAX_USER_INPUT
+#include "shellmemory.h"
+#include "code_cache.h"
+#include "compile.h"
+#include "program.h"
+
+// How many lines of a stream to read at a time.
+#define STREAM_WINDOW 64
+
+// The table of loaded programs: a hash table on (dev, ino), chained
+// through program->next. There's one program per script that's running,
+// and any number of those can be running at once (every nested exec adds
+// more), so it grows with them.
+static struct program **programs = NULL;
+static size_t bucket_count = 0; // a power of two
+static size_t program_count = 0;
+
+static size_t bucket(dev_t dev, ino_t ino, size_t count) {
+    uint64_t h = ((uint64_t)ino ^ ((uint64_t)dev << 32)) * 0x9E3779B97F4A7C15ull;
+    return (h >> 32) & (count - 1);
+}
+
+static struct program *find_program(dev_t dev, ino_t ino) {
+    if (!bucket_count) return NULL;
+    for (struct program *p = programs[bucket(dev, ino, bucket_count)]; p; p = p->next) {
+        if (p->dev == dev && p->ino == ino) return p;
+    }
+    return NULL;
+}
+
+// Returns 0, or -1 if the table is full and can't grow.
+static int add_program(struct program *program) {
+    if (program_count >= bucket_count) {
+        size_t count = bucket_count ? bucket_count * 2 : 64;
+        struct program **table = calloc(count, sizeof(struct program *));
+        if (!table && !bucket_count) return -1;
+        if (table) {
+            for (size_t b = 0; b < bucket_count; ++b) {
+                struct program *p = programs[b];
+                while (p) {
+                    struct program *next = p->next;
+                    size_t b2 = bucket(p->dev, p->ino, count);
+                    p->next = table[b2];
+                    table[b2] = p;
+                    p = next;
+                }
+            }
+            free(programs);
+            programs = table;
+            bucket_count = count;
+        }
+        // (If it can't grow, the chains just get longer.)
+    }
+    struct program **head = &programs[bucket(program->dev, program->ino, bucket_count)];
+    program->next = *head;
+    *head = program;
+    program->in_table = 1;
+    program_count++;
+    return 0;
+}
+
+static struct program *new_program() {
+    struct program *program = malloc(sizeof(struct program));
+    if (!program) return NULL;
+    program->line_base = 0;
+    program->line_count = 0;
+    program->first_line = 0;
+    program->stream = NULL;
+    program->window = 0;
+    program->refcount = 1;
+    program->in_table = 0;
+    program->path = NULL;
+    program->code = NULL;
+    program->processes = NULL;
+    program->next = NULL;
+    return program;
+}
+
+// Hand a loaded text blob over to linememory. offsets[ix] is where line ix
+// starts in text; each line ends just before the next one starts, and the
+// last line ends just before lines_end. Returns 0, or -1 if there isn't
+// room, in which case the caller still owns text.
+static int install_text(struct program *program, char *text, size_t text_size,
+                        int text_mapped, const uint32_t *offsets, size_t count,
+                        size_t lines_end) {
+    if (allocate_lines(count, text, text_size, text_mapped, &program->line_base)) {
+        return -1;
+    }
+    program->line_count = count;
+    for (size_t ix = 0; ix < count; ++ix) {
+        size_t end = ix + 1 < count ? offsets[ix + 1] : lines_end;
+        set_line(program->line_base + ix, offsets[ix], end - offsets[ix] - 1);
+    }
+    return 0;
+}
+
+// Grow the offsets array if it's full.
+static int reserve_offset(uint32_t **offsets, size_t count, size_t *capacity) {
+    if (count < *capacity) return 0;
+    size_t new_capacity = *capacity ? *capacity * 2 : 16;
+    uint32_t *grown = realloc(*offsets, new_capacity * sizeof(uint32_t));
+    if (!grown) return -1;
+    *offsets = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Read up to max_lines lines of script and hand them over to linememory
+// as program's lines. Returns 0, or -1 if we run out of memory.
+static int read_lines(struct program *program, FILE *script, size_t max_lines) {
+    // We're told to assume lines of files are limited to 100 characters.
+    // That's all well and good, but for implementing # we need to read
+    // actual user input, and _that_ is limited to 1000 characters.
+    // It's unclear if we should assume it's also limited to 100 for this
+    // purpose. If you did assume that, that's OK! We didn't.
+    //
+    // linememory wants the lines in one contiguous range, so we need to
+    // know how many there are before we allocate. Read them into one
+    // growing text blob, remembering where each line starts, then hand the
+    // blob over to linememory.
+    // This is only used for streams and files we can't map, like stdin;
+    // see program_open for the usual path.
+    char linebuf[MAX_USER_INPUT];
+    char *text = NULL;
+    size_t text_size = 0, text_capacity = 0;
+    uint32_t *offsets = NULL;
+    size_t count = 0, offsets_capacity = 0;
+    // Loop on fgets rather than feof: feof only becomes true after a read
+    // has already failed, so checking it first gave us a bogus empty line
+    // at the end of every file that ends in a newline.
+    while (count < max_lines && fgets(linebuf, MAX_USER_INPUT, script)) {
+        size_t length = strlen(linebuf);
+
+        if (reserve_offset(&offsets, count, &offsets_capacity)) goto fail;
+        while (text_size + length + 1 > text_capacity) {
+            text_capacity = text_capacity ? text_capacity * 2 : 1024;
+            char *grown = realloc(text, text_capacity);
+            if (!grown) goto fail;
+            text = grown;
+        }
+        offsets[count++] = text_size;
+        memcpy(text + text_size, linebuf, length + 1);
+        text_size += length + 1;
+    }
+
+    // If we've run out of memory, clean up and fail.
+    if (install_text(program, text, text_size, 0, offsets, count, text_size)) {
+        goto fail;
+    }
+    free(offsets);
+    return 0;
+
+fail:
+    free(text);
+    free(offsets);
+    return -1;
+}
+
+static struct program *load_from_FILE(FILE *script) {
+    struct program *program = new_program();
+    if (program && read_lines(program, script, SIZE_MAX)) {
+        free(program);
+        program = NULL;
+    }
+    // We're done with the file, don't forget to close it!
+    fclose(script);
+    return program;
+}
+
+// Compile a freshly loaded program, so that running it doesn't have to parse
+// anything. Releases the program and returns NULL if that fails.
+static struct program *compiled(struct program *program) {
+    if (!program) return NULL;
+    program->code = compile_lines(program->line_base, program->line_count);
+    if (!program->code) {
+        program_release(program);
+        return NULL;
+    }
+    return program;
+}
+
+struct program *program_from_FILE(FILE *script) {
+    return compiled(load_from_FILE(script));
+}
+
+// Read and compile a stream's next window of lines. Returns how many lines
+// it read, which is 0 at the end of the stream, or -1 if there's no room
+// for them. The stream is closed once it's all been read.
+static int read_window(struct program *program) {
+    if (!program->stream) return 0;
+    if (read_lines(program, program->stream, program->window)) return -1;
+    program->code = compile_lines(program->line_base, program->line_count);
+    if (!program->code) {
+        free_lines(program->line_base, program->line_count);
+        program->line_count = 0;
+        return -1;
+    }
+    // A short window means the stream has ended (or failed).
+    if (program->line_count < program->window) {
+        fclose(program->stream);
+        program->stream = NULL;
+    }
+    return program->line_count;
+}
+
+struct program *program_from_stream(FILE *script) {
+    struct program *program = new_program();
+    if (!program) {
+        fclose(script);
+        return NULL;
+    }
+    program->stream = script;
+    // Only read ahead in a file. Lines from a pipe or a terminal might
+    // not have been written yet, and the ones we have should run without
+    // waiting for them.
+    struct stat st;
+    int is_file = fstat(fileno(script), &st) == 0 && S_ISREG(st.st_mode);
+    program->window = is_file ? STREAM_WINDOW : 1;
+    if (read_window(program) < 0) {
+        program_release(program);
+        return NULL;
+    }
+    return program;
+}
+
+int program_has_line(struct program *program, size_t n) {
+    while (n >= program->first_line + program->line_count) {
+        if (!program->stream) return 0;
+        // Every line in memory has run; swap them for the next window.
+        free_lines(program->line_base, program->line_count);
+        free_code(program->code);
+        program->code = NULL;
+        program->first_line += program->line_count;
+        program->line_count = 0;
+        int got = read_window(program);
+        if (got < 0) {
+            // The other programs are using all of linememory. We can't
+            // wait for them to finish (they're queued behind us), so this
+            // is as far as we get.
+            fprintf(stderr, "Out of memory for shell input; ignoring the rest\n");
+            fclose(program->stream);
+            program->stream = NULL;
+        }
+        if (got <= 0) return 0;
+    }
+    return 1;
+}
+
+// Load a script by mapping it into memory, rather than copying it through
+// a line buffer. The mapping is private, so we can turn each newline into a
+// NUL in place, and then the lines are already the NUL-terminated strings
+// linememory wants; the mapping itself becomes the program's text.
+// Finding the newlines is one pass of memchr, which is vectorized.
+//
+// The last line might not end in a newline. Then its terminator is the byte
+// just past the end of the file, which is in the zero-filled tail of the
+// last page -- unless the file fills its last page exactly, in which case
+// there's no such byte. In that case, and any other we can't map, this
+// returns NULL with *fallback set, and the caller reads the file instead.
+static struct program *program_from_mapping(int fd, size_t size, int *fallback) {
+    *fallback = 1;
+    if (size == 0 || size > UINT32_MAX) return NULL;
+
+    char *text = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) return NULL;
+    int ends_in_newline = text[size - 1] == '\n';
+    if (!ends_in_newline && size % (size_t)sysconf(_SC_PAGESIZE) == 0) {
+        munmap(text, size);
+        return NULL;
+    }
+    *fallback = 0;
+
+    struct program *program = new_program();
+    uint32_t *offsets = NULL;
+    size_t count = 0, offsets_capacity = 0;
+    if (!program) goto fail;
+
+    char *start = text, *end = text + size;
+    while (start < end) {
+        if (reserve_offset(&offsets, count, &offsets_capacity)) goto fail;
+        offsets[count++] = start - text;
+        char *newline = memchr(start, '\n', end - start);
+        if (!newline) break;
+        *newline = '\0';
+        start = newline + 1;
+    }
+
+    // Without a trailing newline, the last line's terminator is at text+size.
+    size_t lines_end = ends_in_newline ? size : size + 1;
+    if (install_text(program, text, size, 1, offsets, count, lines_end)) {
+        goto fail;
+    }
+    free(offsets);
+    return program;
+
+fail:
+    munmap(text, size);
+    free(offsets);
+    free(program);
+    return NULL;
+}
+
+struct program *program_open(const char *path) {
+    FILE *script = fopen(path, "rt");
+    if (!script) {
+        perror("failed to open file for create_process");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fileno(script), &st)) {
+        perror("failed to stat file for create_process");
+        fclose(script);
+        return NULL;
+    }
+
+    // Already loaded? Then share it.
+    struct program *program = find_program(st.st_dev, st.st_ino);
+    if (program) {
+        fclose(script);
+        program->refcount++;
+        return program;
+    }
+
+    // Compiled before, and not changed since? Then that's all there is to do.
+    if (S_ISREG(st.st_mode) && code_cache_enabled()) {
+        program = new_program();
+        if (program && code_cache_load(program, path, fileno(script), &st)) {
+            free(program);
+            program = NULL;
+        }
+    }
+    if (program) {
+        fclose(script);
+    } else {
+        int fallback = 1;
+        if (S_ISREG(st.st_mode)) {
+            program = program_from_mapping(fileno(script), st.st_size, &fallback);
+        }
+        if (fallback) {
+            // takes ownership of script.
+            program = load_from_FILE(script);
+        } else {
+            fclose(script);
+        }
+        program = compiled(program);
+        if (!program) return NULL;
+        if (S_ISREG(st.st_mode)) code_cache_store(program, path, &st);
+    }
+    program->path = strdup(path);
+    program->dev = st.st_dev;
+    program->ino = st.st_ino;
+    if (add_program(program)) {
+        program_release(program);
+        return NULL;
+    }
+    return program;
+}
+
+struct program *program_find(const char *path) {
+    struct stat st;
+    if (stat(path, &st)) return NULL;
+    return find_program(st.st_dev, st.st_ino);
+}
+
+void program_release(struct program *program) {
+    if (--program->refcount) return;
+
+    if (program->in_table) {
+        struct program **link = &programs[bucket(program->dev, program->ino, bucket_count)];
+        while (*link != program) link = &(*link)->next;
+        *link = program->next;
+        program_count--;
+    }
+    free_lines(program->line_base, program->line_count);
+    free_code(program->code);
+    if (program->stream) fclose(program->stream);
+    free(program->path);
+    free(program);
+}
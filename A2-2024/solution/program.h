@@ -0,0 +1,74 @@
+#pragma once
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct code;
+struct PCB;
+
+// A program is the text of a script, loaded into linememory.
+//
+// Several processes can run the same script at once, each with its own pc,
+// so they share one copy of its text rather than loading it N times. Loaded
+// programs are kept in a table keyed by the file's identity (device and
+// inode, so `a/b`, `a/../a/b` and hardlinks all find the same program), and
+// reference counted: the text is freed when the last process using it goes
+// away. Each program also lists the processes running it, so together with
+// the pid index in pcb.c, this is the process table.
+struct program {
+    // Where the text lives in linememory. line_base can change if the
+    // linememory is compacted, so always read it from here.
+    // These are lines first_line onwards of the program. For a stream (see
+    // below) the earlier ones have already been run and freed; for
+    // anything else first_line is 0, and these are all of its lines.
+    size_t line_base;
+    size_t line_count;
+    size_t first_line;
+
+    // For a program read from a stream as it runs: where the rest of it
+    // comes from (NULL once it's all been read), and how many lines to
+    // read at a time.
+    FILE *stream;
+    size_t window;
+
+    size_t refcount;
+
+    // The lines, compiled; see compile.h.
+    struct code *code;
+
+    // Identity of the script file. Programs that aren't in the table
+    // (e.g. the shell input process) have in_table == 0.
+    int in_table;
+    dev_t dev;
+    ino_t ino;
+    char *path;
+
+    // The live processes running this program, through
+    // pcb->next_in_program. Kept up to date by pcb.c.
+    struct PCB *processes;
+
+    struct program *next; // next program in the same bucket of the table
+};
+
+// Get the program for the script at path, loading it if nobody is using it
+// already. Returns a new reference, or NULL if the file can't be opened or
+// there's no room to load it.
+struct program *program_open(const char *path);
+// The program for the script at path, if it's loaded; NULL otherwise.
+// Doesn't add a reference.
+struct program *program_find(const char *path);
+// Load a program from a FILE* without entering it into the table.
+// Ownership of the FILE* is taken and it will be closed.
+struct program *program_from_FILE(FILE *f);
+// Like program_from_FILE, but only reads a window of lines now, and the
+// rest as the program gets to them (see program_has_line), so it can start
+// running before the end of f arrives, and however long f is, only a
+// window of it is in memory at once. For the shell input process.
+// A stream program can only have one process running it at once.
+struct program *program_from_stream(FILE *f);
+// Returns non-zero iff the program has a line n. For a stream, reaching
+// the end of the lines in memory reads the next window of them (and frees
+// the current ones, so only ask about line n once line n-1 has run).
+int program_has_line(struct program *p, size_t n);
+// Drop a reference; the last one frees the program and its text.
+void program_release(struct program *p);
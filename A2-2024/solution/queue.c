@@ -1,104 +1,210 @@
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "output.h"
 #include "pcb.h"
 #include "queue.h"
+#include "shellmemory.h" // MEM_SIZE
 
 struct queue {
-    struct PCB *head;
+    // The PCBs on the queue. A deque keeps them in a ring: the one at the
+    // front is items[head], and the rest follow it, wrapping around at
+    // capacity (always a power of two). A heap keeps them as a binary
+    // min-heap by (queue_key, queue_seq); head stays 0.
+    struct PCB **items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    int heap;
 
-    // Why no tail? Simply put; there's only ever 4 items in our queue.
-    // Dereferencing 4 pointers is not so slow.
-    // On the other hand, properly implementing the bookkeeping for a tail
-    // pointer is headache-inducing!
-    //struct PCB *tail;
+    // Heaps only. Every PCB enqueued by priority gets the next seq, so
+    // ties on the key are broken FCFS. enqueue_ignoring_priority counts
+    // down from -1 instead, so the latest of those is ahead of everything.
+    int64_t next_seq;
+    int64_t front_seq;
+    // Aging only: how many times the queue has been aged (the epoch), and
+    // how. See effective_duration.
+    int64_t age;
+    int64_t aging_rate;
+    int64_t aging_floor;
 
-    // pthread_mutex_t lock;
+    // MLFQ only: a deque per level, level 0 first; the queue's own items
+    // are unused. clock is how many steps the processes have run, as far
+    // as the queue has seen, and every boost steps of it, everything goes
+    // back to level 0.
+    struct queue *levels[MLFQ_MAX_LEVELS];
+    size_t level_count;
+    size_t clock;
+    size_t boost;
+    size_t next_boost;
 };
 
-// INVARIANT:
-// If a PCB is not currently on the queue, its next pointer is NULL.
-
-struct queue *alloc_queue() {
-    struct queue *q = malloc(sizeof(struct queue));
-    q->head = NULL;
+static struct queue *alloc_queue(int heap) {
+    struct queue *q = calloc(1, sizeof(struct queue));
+    if (!q) return NULL;
+    q->heap = heap;
+    q->front_seq = -1;
+    q->aging_rate = 1;
+    q->aging_floor = 0;
     return q;
 }
 
+struct queue *alloc_deque() {
+    return alloc_queue(0);
+}
+
+struct queue *alloc_heap() {
+    return alloc_queue(1);
+}
+
+static struct PCB *item(struct queue *q, size_t i) {
+    return q->items[(q->head + i) & (q->capacity - 1)];
+}
+
 void free_queue(struct queue *q) {
     // Free all PCBs in the queue as well!
     // This might be relevant if we discover an error
-    // while creating the schedule, e.g. can't open a file or
-    // two scripts have the same name.
-    struct PCB *p = q->head;
-    while (p) {
-        struct PCB *next = p->next;
-        free_pcb(p);
-        p = next;
+    // while creating the schedule, e.g. can't open a file.
+    if (q->levels[0]) {
+        // An MLFQ's PCBs are all on its levels.
+        for (size_t l = 0; l < MLFQ_MAX_LEVELS; ++l) {
+            if (q->levels[l]) free_queue(q->levels[l]);
+        }
+    } else {
+        for (size_t i = 0; i < q->count; ++i) {
+            free_pcb(item(q, i));
+        }
     }
+    free(q->items);
     free(q);
 }
 
-int program_already_scheduled(struct queue *q, char *name) {
-    struct PCB *p = q->head;
-    while (p) {
-        if (strcmp(p->name, name) == 0) return 1;
-        p = p->next;
+// Make room for one more PCB. Doubling unwraps the ring, so it's also
+// fine for a heap, which never wraps.
+static int reserve(struct queue *q) {
+    if (q->count < q->capacity) return 0;
+    size_t capacity = q->capacity ? q->capacity * 2 : 16;
+    struct PCB **items = malloc(capacity * sizeof(struct PCB *));
+    if (!items) return -1;
+    for (size_t i = 0; i < q->count; ++i) {
+        items[i] = item(q, i);
     }
+    free(q->items);
+    q->items = items;
+    q->capacity = capacity;
+    q->head = 0;
     return 0;
 }
 
+// There's nowhere to put the PCB, and nothing to tell the caller with, so
+// the process is lost. Only happens when we're out of memory anyway.
+static int no_room(struct queue *q, struct PCB *pcb) {
+    if (reserve(q) == 0) return 0;
+    fprintf(stderr, "Out of memory for the ready queue; dropping %s\n",
+            pcb->name);
+    free_pcb(pcb);
+    return 1;
+}
+
+// Deque (FCFS, RR)
 
 void enqueue_ignoring_priority(struct queue *q, struct PCB *pcb) {
-    pcb->next = q->head;
-    q->head = pcb;
+    assert(!q->heap);
+    if (no_room(q, pcb)) return;
+    q->head = (q->head - 1) & (q->capacity - 1);
+    q->items[q->head] = pcb;
+    q->count++;
 }
 
 void enqueue_fcfs(struct queue *q, struct PCB *pcb) {
-    // sanity check: some dequeue operation didn't do its job if this isn't NULL.
-    assert(pcb->next == NULL);
-    struct PCB *p = q->head;
+    assert(!q->heap);
+    if (no_room(q, pcb)) return;
+    q->items[(q->head + q->count) & (q->capacity - 1)] = pcb;
+    q->count++;
+}
 
-    if (!p) {
-        q->head = pcb;
-        return;
+struct PCB *dequeue_typical(struct queue *q) {
+    if (q->count == 0) {
+        return NULL;
     }
+    struct PCB *head = q->items[q->head];
+    q->head = (q->head + 1) & (q->capacity - 1);
+    q->count--;
+    return head;
+}
 
-    // otherwise p is a real PCB.
-    // Until it's the tail, step down the list.
-    while (p->next) {
-        p = p->next;
-    }
+// Heap (SJF, AGING)
 
-    // Now p is the current tail of the queue. Append pcb.
-    p->next = pcb;
+static int before(const struct PCB *a, const struct PCB *b) {
+    return a->queue_key < b->queue_key
+        || (a->queue_key == b->queue_key && a->queue_seq < b->queue_seq);
 }
 
-void enqueue_sjf(struct queue *q, struct PCB *pcb) {
-    size_t dur = pcb->duration;
-
-    struct PCB *p = q->head;
-    // if the queue was empty, or the head is a longer job than pcb,
-    // pcb is just the new head.
-    if (!p || p->duration > dur) {
-        pcb->next = p;
-        q->head = pcb;
-        return;
+static void heap_push(struct queue *q, struct PCB *pcb) {
+    assert(q->heap);
+    if (no_room(q, pcb)) return;
+    size_t i = q->count++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!before(pcb, q->items[parent])) break;
+        q->items[i] = q->items[parent];
+        i = parent;
     }
+    q->items[i] = pcb;
+}
 
-    // Otherwise, the queue was not empty. As long as the next item exists,
-    // check it. If its duration is longer than dur, pcb goes between
-    // p and p->next. Otherwise, step and try again.
-    while (p->next) {
-        if (p->next->duration > dur) {
-            pcb->next = p->next;
-            p->next = pcb;
-            return;
+static struct PCB *heap_pop(struct queue *q) {
+    if (q->count == 0) {
+        return NULL;
+    }
+    struct PCB *top = q->items[0];
+    struct PCB *last = q->items[--q->count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= q->count) break;
+        if (child + 1 < q->count && before(q->items[child + 1], q->items[child])) {
+            child++;
         }
-        p = p->next;
+        if (!before(q->items[child], last)) break;
+        q->items[i] = q->items[child];
+        i = child;
+    }
+    if (q->count) q->items[i] = last;
+    return top;
+}
+
+void enqueue_ignoring_priority_heap(struct queue *q, struct PCB *pcb) {
+    pcb->queue_key = INT64_MIN;
+    pcb->queue_seq = q->front_seq--;
+    heap_push(q, pcb);
+}
+
+void enqueue_sjf(struct queue *q, struct PCB *pcb) {
+    pcb->queue_key = pcb->duration;
+    pcb->queue_seq = q->next_seq++;
+    heap_push(q, pcb);
+}
+
+// Aging is lazy: rather than every dequeue taking aging_rate off the
+// duration of everything still waiting, the queue counts how many times
+// it would have, and works out a PCB's duration when it's needed:
+//   max(aging_floor, duration when enqueued - aging_rate * times aged since)
+// (so anything shorter than the floor counts as the floor).
+// The heap key is that duration before the floor, plus aging_rate times the
+// age when it was enqueued -- like a deadline. The same amount comes off
+// every waiting PCB, so keys stay in the order their durations put them
+// in, even once some of those have hit the floor: anything that has has a
+// key no bigger than floor + aging_rate * age, and a newcomer's is at
+// least that.
+static size_t effective_duration(struct queue *q, struct PCB *pcb) {
+    int64_t aged = pcb->duration;
+    if (pcb->queue_key != INT64_MIN) {
+        aged -= q->aging_rate * (q->age - pcb->queue_age);
     }
-    // If we make it to the end, then this is the longest job.
-    p->next = pcb;
+    return aged > q->aging_floor ? aged : q->aging_floor;
 }
 
 void enqueue_aging(struct queue *q, struct PCB *pcb) {
@@ -119,49 +225,124 @@ void enqueue_aging(struct queue *q, struct PCB *pcb) {
     // scheduled will **always** run at least one step.
     // Therefore, we can tell whether or not we are in the initial case
     // by checking if pcb->pc is 0.
-    if (q->head && q->head->duration == pcb->duration && pcb->pc) {
-        enqueue_ignoring_priority(q, pcb);
+    int64_t duration = pcb->duration;
+    if (duration < q->aging_floor) duration = q->aging_floor;
+    pcb->duration = duration;
+    pcb->queue_age = q->age;
+    if (q->count && effective_duration(q, q->items[0]) == (size_t)duration && pcb->pc) {
+        enqueue_ignoring_priority_heap(q, pcb);
     } else {
-        enqueue_sjf(q, pcb);
+        pcb->queue_key = duration + q->aging_rate * q->age;
+        pcb->queue_seq = q->next_seq++;
+        heap_push(q, pcb);
     }
 }
 
+void set_aging(struct queue *q, size_t rate, size_t floor) {
+    // Only before anything has been aged, or the keys would be off.
+    // No program is longer than MEM_SIZE lines, so past that, a bigger rate
+    // or floor makes no difference: one aging takes anything to the floor,
+    // or everything is at the floor already. Capping them there keeps
+    // aging_rate * age (and the keys) well clear of overflow.
+    q->aging_rate = rate < MEM_SIZE ? rate : MEM_SIZE;
+    q->aging_floor = floor < MEM_SIZE ? floor : MEM_SIZE;
+}
 
-struct PCB *dequeue_typical(struct queue *q) {
-    if (q->head == NULL) {
-        return NULL;
-    }
-
-    // q -> head -> next
-    struct PCB *head = q->head;
-    // q -> next
-    q->head = head->next;
-
-    head->next = NULL;
-    return head;
+struct PCB *dequeue_sjf(struct queue *q) {
+    return heap_pop(q);
 }
 
 void debug_with_age(struct queue *q) {
-    struct PCB *pcb = q->head;
-    printf("q");
-    while (pcb) {
-        printf(" -> %ld %s", pcb->duration, pcb->name);
-        pcb = pcb->next;
+    out_printf("q");
+    for (size_t i = 0; i < q->count; ++i) {
+        struct PCB *pcb = item(q, i);
+        out_printf(" -> %ld %s", effective_duration(q, pcb), pcb->name);
     }
-    printf("\n");
+    out_printf("\n");
 }
 
 struct PCB *dequeue_aging(struct queue *q) {
     //debug_with_age(q);
-    struct PCB *r = dequeue_typical(q);
+    struct PCB *r = heap_pop(q);
+    if (!r) return NULL;
+    // The dequeued PCB has aged until now; everything else ages once more.
+    r->duration = effective_duration(q, r);
+    q->age++;
+    return r;
+}
 
-    struct PCB *p = q->head;
-    while (p) {
-        if (p->duration > 0) {
-            p->duration--;
+// MLFQ
+
+struct queue *alloc_mlfq() {
+    struct queue *q = alloc_queue(0);
+    if (!q) return NULL;
+    for (size_t l = 0; l < MLFQ_MAX_LEVELS; ++l) {
+        q->levels[l] = alloc_deque();
+        if (!q->levels[l]) {
+            free_queue(q);
+            return NULL;
         }
-        p = p->next;
     }
+    set_feedback(q, MLFQ_DEFAULT_LEVELS, MLFQ_DEFAULT_BOOST);
+    return q;
+}
 
-    return r;
+void set_feedback(struct queue *q, size_t levels, size_t boost) {
+    q->level_count = levels;
+    q->boost = boost;
+    q->next_boost = boost;
+}
+
+// Everything waiting goes back to level 0, behind what's there already,
+// in the order it was in.
+static void boost(struct queue *q) {
+    for (size_t l = 1; l < q->level_count; ++l) {
+        struct PCB *pcb;
+        while ((pcb = dequeue_typical(q->levels[l]))) {
+            pcb->queue_level = 0;
+            enqueue_fcfs(q->levels[0], pcb);
+        }
+    }
+}
+
+void enqueue_mlfq(struct queue *q, struct PCB *pcb) {
+    // New processes start at the top. Anything else is back because it
+    // used up its time slice (or it'd have finished), so it's CPU-heavy:
+    // it goes down a level, where slices are longer and come round less
+    // often. (pc is 0 only for a process that hasn't run yet, as with
+    // enqueue_aging.)
+    if (pcb->pc == 0) {
+        pcb->queue_level = 0;
+    } else {
+        q->clock += pcb->pc - pcb->queue_pc;
+        if (pcb->queue_level + 1 < q->level_count) pcb->queue_level++;
+    }
+    if (q->boost && q->clock >= q->next_boost) {
+        boost(q);
+        pcb->queue_level = 0;
+        q->next_boost = q->clock + q->boost;
+    }
+    enqueue_fcfs(q->levels[pcb->queue_level], pcb);
+    q->count++;
+}
+
+void enqueue_ignoring_priority_mlfq(struct queue *q, struct PCB *pcb) {
+    // It keeps its level; it's only at the top to be dequeued next. (It's
+    // new, or back from a nested exec part way through its slice.)
+    if (pcb->pc == 0) pcb->queue_level = 0;
+    else q->clock += pcb->pc - pcb->queue_pc;
+    enqueue_ignoring_priority(q->levels[0], pcb);
+    q->count++;
+}
+
+struct PCB *dequeue_mlfq(struct queue *q) {
+    for (size_t l = 0; l < q->level_count; ++l) {
+        struct PCB *pcb = dequeue_typical(q->levels[l]);
+        if (pcb) {
+            q->count--;
+            pcb->queue_pc = pcb->pc;
+            return pcb;
+        }
+    }
+    return NULL;
 }
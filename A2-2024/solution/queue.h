@@ -13,7 +13,7 @@
 //  1. run_pcb_to_completion
 //  2. run_pcb_for_n_steps
 // These functions can be used to actually _run_ the processes that we
-// schedule, and are each useful for -- you guessed it -- various policies.
+// schedule, for as long as the policy's quantum says.
 //
 // The schedule_policy.{h,c} file defines a schedule_policy struct which
 // contains pointers to the functions which will appropriately implement
@@ -25,7 +25,7 @@
 //  1. void enqueue(struct queue *q, struct PCB *pcb)
 //  2. void enqueue_ignoring_priority(struct queue *q, struct PCB *pcb)
 //  3. struct PCB *dequeue(struct queue *q)
-// We also need generic functions for allocating and de-allocating queues.
+// We also need functions for allocating and de-allocating queues.
 //
 // To avoid duplication, see the documentation on the members of
 // struct schedule_policy.
@@ -33,6 +33,7 @@
 // Has to be defined before including schedule_policy,
 // because schedule_policy.h requires this definition.
 struct queue;
+struct PCB;
 
 #include "schedule_policy.h"
 
@@ -44,31 +45,59 @@ struct queue;
 // and provides policy-agnostic interfaces to everything in the schedule_policy
 // and not just the queue stuff.
 
-// All of our policies share a single queue type. If that weren't the case,
-// we could add alloc/dealloc functions to the policy struct and replace
-// struct queue pointers with void pointers everywhere.
+// Each policy picks the kind of queue that suits it, by which alloc
+// function it uses; the other functions must then be ones for that kind.
+// FCFS and RR only ever take from the front and add to either end, so a
+// ring deque does everything in O(1). SJF and AGING need the shortest job
+// first, so they use a binary heap, O(log n) either way. Both are an array
+// of PCB pointers underneath. MLFQ has a deque per level. free_queue works
+// on any of them.
 
-struct queue *alloc_queue();
+struct queue *alloc_deque();
+struct queue *alloc_heap();
+struct queue *alloc_mlfq();
 void free_queue(struct queue *q);
 
-// To determine if processes have the same name, we need a way of scanning
-// the queue contents for a given filename.
-int program_already_scheduled(struct queue *q, char *name);
-
-// This particular function is policy-agnostic, but its interface matches
-// the regular enqueue function just to keep things clean.
+// Deques (FCFS, RR)
 void enqueue_ignoring_priority(struct queue *q, struct PCB *pcb);
-
-// FCFS, RR
 void enqueue_fcfs(struct queue *q, struct PCB *pcb);
+struct PCB *dequeue_typical(struct queue *q);
+
+// Heaps (SJF, AGING)
+// The heap's version of enqueue_ignoring_priority: pcb comes out of the
+// next dequeue, whatever its duration.
+void enqueue_ignoring_priority_heap(struct queue *q, struct PCB *pcb);
 // SJF
 void enqueue_sjf(struct queue *q, struct PCB *pcb);
+struct PCB *dequeue_sjf(struct queue *q);
 // Aging
-// enqueue_sjf is almost correct, but we should leave the given pcb at the head
+// Like enqueue_sjf, except that we should leave the given pcb at the head
 // if it's tied with the current head, rather than doing an FCFS tiebreak.
 void enqueue_aging(struct queue *q, struct PCB *pcb);
-
-// FCFS, RR, SJF
-struct PCB *dequeue_typical(struct queue *q);
-// Aging
+// Each dequeue ages everything left on the queue: its duration goes down by
+// rate, but not below floor. Aging is done lazily, so this is O(log n)
+// like dequeue_sjf.
 struct PCB *dequeue_aging(struct queue *q);
+// Set the rate and floor, which are 1 and 0 unless this is called right
+// after the queue is allocated. Both are capped at MEM_SIZE, the most lines
+// a program can have; beyond that they make no difference.
+void set_aging(struct queue *q, size_t rate, size_t floor);
+
+// MLFQ (multi-level feedback queue)
+// Processes start on level 0. One that uses up its time slice is moved
+// down a level (the time slice is up to the policy: see schedule_policy.c).
+// Dequeue takes from the highest non-empty level, FCFS within each.
+// When the processes have run for boost steps in total since the last
+// boost, every waiting process is moved back up to level 0, so nothing
+// starves. That's O(n); everything else is O(levels).
+#define MLFQ_MAX_LEVELS 8
+// What an MLFQ has unless set_feedback says otherwise.
+#define MLFQ_DEFAULT_LEVELS 4
+#define MLFQ_DEFAULT_BOOST 200
+void enqueue_mlfq(struct queue *q, struct PCB *pcb);
+void enqueue_ignoring_priority_mlfq(struct queue *q, struct PCB *pcb);
+struct PCB *dequeue_mlfq(struct queue *q);
+// Set the number of levels (1 to MLFQ_MAX_LEVELS) and the boost period
+// (0 for never), which are MLFQ_DEFAULT_LEVELS and MLFQ_DEFAULT_BOOST unless
+// this is called right after the queue is allocated.
+void set_feedback(struct queue *q, size_t levels, size_t boost);
@@ -0,0 +1,117 @@
+// Unoptimized, every intrinsic below becomes a function call that spills
+// to the stack, which makes the vector code slower than the plain byte loop
+// it replaces. So always optimize this file, whatever CFLAGS says.
+#pragma GCC optimize("O2")
+
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// The classifiers read the whole aligned block around a string, bytes
+// before and after it included. That's deliberate, and can't fault: an
+// aligned 64-byte block never crosses a page, so if any byte of it is
+// mapped, all of it is. But to AddressSanitizer it's an out-of-bounds read
+// (of the stack buffer typed input goes in, for a start), so tell it not
+// to instrument them; the tokenizer ignores the extra bytes anyway.
+#if defined(__has_attribute)
+#if __has_attribute(no_sanitize_address)
+#define SCAN_OVERREADS __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef SCAN_OVERREADS
+#define SCAN_OVERREADS
+#endif
+
+#ifdef SCAN_X86
+// isspace() in the C locale (which the shell never changes) is ' ' and
+// '\t' '\n' '\v' '\f' '\r', which are 9 to 13; a byte is in that range iff
+// byte - 9 is at most 4, as unsigned bytes.
+
+SCAN_OVERREADS
+static void classify_sse2(const char *block, uint64_t *spaces, uint64_t *stops) {
+    uint64_t sp = 0, st = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i x = _mm_load_si128((const __m128i *)block + i);
+        __m128i t = _mm_sub_epi8(x, _mm_set1_epi8(9));
+        __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+        __m128i space = _mm_or_si128(ctl, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+        __m128i stop = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_setzero_si128()),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8('\n'))),
+            _mm_cmpeq_epi8(x, _mm_set1_epi8(';')));
+        sp |= (uint64_t)(unsigned)_mm_movemask_epi8(space) << (16 * i);
+        st |= (uint64_t)(unsigned)_mm_movemask_epi8(stop) << (16 * i);
+    }
+    *spaces = sp;
+    *stops = st;
+}
+
+__attribute__((target("avx2"))) SCAN_OVERREADS
+static void classify_avx2(const char *block, uint64_t *spaces, uint64_t *stops) {
+    uint64_t sp = 0, st = 0;
+    for (int i = 0; i < 2; ++i) {
+        __m256i x = _mm256_load_si256((const __m256i *)block + i);
+        __m256i t = _mm256_sub_epi8(x, _mm256_set1_epi8(9));
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(4)), t);
+        __m256i space = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+        __m256i stop = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_setzero_si256()),
+                            _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n'))),
+            _mm256_cmpeq_epi8(x, _mm256_set1_epi8(';')));
+        sp |= (uint64_t)(unsigned)_mm256_movemask_epi8(space) << (32 * i);
+        st |= (uint64_t)(unsigned)_mm256_movemask_epi8(stop) << (32 * i);
+    }
+    *spaces = sp;
+    *stops = st;
+}
+#endif
+
+struct scanner {
+    const char *name;
+    scan_classifier classify;
+};
+
+// In order of preference.
+static const struct scanner scanners[] = {
+#ifdef SCAN_X86
+    { "avx2", classify_avx2 },
+    { "sse2", classify_sse2 },
+#endif
+    { "scalar", NULL },
+};
+
+static int supported(const struct scanner *scanner) {
+#ifdef SCAN_X86
+    if (strcmp(scanner->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(scanner->name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+// The scanner in use, picked the first time it's asked for: the first
+// supported one in the list above. Every thread would pick the same one,
+// so it doesn't matter if several threads race to pick it.
+static const struct scanner *scanner = NULL;
+
+scan_classifier scan_get_classifier() {
+    if (!scanner) {
+        const struct scanner *s = scanners;
+        while (!supported(s)) s++;
+        scanner = s;
+    }
+    return scanner->classify;
+}
+
+int scan_use(const char *name) {
+    for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); ++i) {
+        if (strcmp(scanners[i].name, name) == 0 && supported(&scanners[i])) {
+            scanner = &scanners[i];
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+
+// Vectorized classification of text, for the tokenizer.
+//
+// A classifier looks at the 64 bytes at block, which must be 64-byte
+// aligned, and sets bit i of *spaces iff block[i] is whitespace (isspace),
+// and bit i of *stops iff block[i] ends a command: NUL, '\n' or ';'.
+// Because the block is aligned, it never crosses a page boundary, so it's
+// safe to classify the whole block around a string even if the string
+// starts after the block does or ends before it.
+typedef void (*scan_classifier)(const char *block, uint64_t *spaces,
+                                uint64_t *stops);
+
+// The classifier to use on this CPU: AVX2 (32 bytes at a time) or SSE2
+// (16 bytes at a time), picked at runtime. Returns NULL if neither is
+// available, in which case scan byte by byte.
+scan_classifier scan_get_classifier(void);
+
+// For benchmarking and testing, force a particular implementation:
+// "scalar", "sse2" or "avx2". Returns 0, or -1 if that one isn't
+// available here.
+int scan_use(const char *name);
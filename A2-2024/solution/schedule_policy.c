@@ -1,57 +1,135 @@
+#include <stdint.h>
 #include <string.h>
-#include "interpreter.h"
+#include "pcb.h"
 #include "schedule_policy.h"
 
-#define MAKE_PREEMPTIVE_FN(n)                        \
-  struct PCB * run_steps_##n (struct PCB *pcb) {     \
-    return run_pcb_for_n_steps(pcb, n);              \
-  }
-
-MAKE_PREEMPTIVE_FN(1)
-MAKE_PREEMPTIVE_FN(2)
-MAKE_PREEMPTIVE_FN(30)
-
 const struct schedule_policy FCFS = {
-    .run_pcb = run_pcb_to_completion,
+    .name = "FCFS",
+    .quantum = SIZE_MAX,
+    .alloc_queue = alloc_deque,
     .enqueue = enqueue_fcfs,
     .dequeue = dequeue_typical,
     .enqueue_ignoring_priority = enqueue_ignoring_priority
 };
 
 const struct schedule_policy SJF = {
-    .run_pcb = run_pcb_to_completion,
+    .name = "SJF",
+    .quantum = SIZE_MAX,
+    .alloc_queue = alloc_heap,
     .enqueue = enqueue_sjf,
-    .dequeue = dequeue_typical,
-    .enqueue_ignoring_priority = enqueue_ignoring_priority
+    .dequeue = dequeue_sjf,
+    .enqueue_ignoring_priority = enqueue_ignoring_priority_heap
 };
 
 const struct schedule_policy RR = {
-    .run_pcb = run_steps_2,
+    .name = "RR",
+    .quantum = 2,
+    .alloc_queue = alloc_deque,
     .enqueue = enqueue_fcfs,
     .dequeue = dequeue_typical,
     .enqueue_ignoring_priority = enqueue_ignoring_priority
 };
 
 const struct schedule_policy RR30 = {
-    .run_pcb = run_steps_30,
+    .name = "RR30",
+    .quantum = 30,
+    .alloc_queue = alloc_deque,
     .enqueue = enqueue_fcfs,
     .dequeue = dequeue_typical,
     .enqueue_ignoring_priority = enqueue_ignoring_priority
 };
 
 const struct schedule_policy AGING = {
-    .run_pcb = run_steps_1,
+    .name = "AGING",
+    .quantum = 1,
+    .ages = 1,
+    .alloc_queue = alloc_heap,
     .enqueue = enqueue_aging,
     .dequeue = dequeue_aging,
-    .enqueue_ignoring_priority = enqueue_ignoring_priority
+    .enqueue_ignoring_priority = enqueue_ignoring_priority_heap
+};
+
+// Level n gets twice the time of the level above.
+static size_t mlfq_time_slice(const struct schedule_params *params,
+                              const struct PCB *pcb) {
+    if (params->quantum > SIZE_MAX >> pcb->queue_level) return SIZE_MAX;
+    return params->quantum << pcb->queue_level;
+}
+
+const struct schedule_policy MLFQ = {
+    .name = "MLFQ",
+    .quantum = 2,
+    .feedback = 1,
+    .time_slice = mlfq_time_slice,
+    .alloc_queue = alloc_mlfq,
+    .enqueue = enqueue_mlfq,
+    .dequeue = dequeue_mlfq,
+    .enqueue_ignoring_priority = enqueue_ignoring_priority_mlfq
+};
+
+static const struct schedule_policy *policies[] = {
+    &FCFS, &SJF, &RR, &RR30, &AGING, &MLFQ,
 };
 
-const struct schedule_policy *get_policy(const char *policy_name) {
-    if (strcmp(policy_name, "FCFS")  == 0) return &FCFS;
-    if (strcmp(policy_name, "SJF")   == 0) return &SJF;
-    if (strcmp(policy_name, "RR")    == 0) return &RR;
-    if (strcmp(policy_name, "RR30")  == 0) return &RR30;
-    if (strcmp(policy_name, "AGING") == 0) return &AGING;
+static size_t default_aging_rate = 1;
+static size_t default_aging_floor = 0;
+
+void set_default_aging(size_t rate, size_t floor) {
+    default_aging_rate = rate;
+    default_aging_floor = floor;
+}
+
+// Parse the digits at s into *out, and point *end after them.
+// Returns 0, or -1 if there aren't any, or too many.
+static int parse_number(const char *s, const char **end, size_t *out) {
+    size_t n = 0;
+    const char *p = s;
+    for ( ; *p >= '0' && *p <= '9'; ++p) {
+        if (n > (SIZE_MAX - 9) / 10) return -1;
+        n = n * 10 + (*p - '0');
+    }
+    if (p == s) return -1;
+    *end = p;
+    *out = n;
+    return 0;
+}
+
+const struct schedule_policy *get_policy(const char *spec,
+                                         struct schedule_params *params) {
+    size_t name_length = strcspn(spec, ":");
+    const struct schedule_policy *policy = NULL;
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+        if (strlen(policies[i]->name) == name_length
+            && strncmp(policies[i]->name, spec, name_length) == 0) {
+            policy = policies[i];
+        }
+    }
+    if (!policy) return NULL;
 
-    return NULL;
+    params->quantum = policy->quantum;
+    params->aging_rate = default_aging_rate;
+    params->aging_floor = default_aging_floor;
+    params->levels = MLFQ_DEFAULT_LEVELS;
+    params->boost = MLFQ_DEFAULT_BOOST;
+    const char *p = spec + name_length;
+    while (*p == ':') {
+        p++;
+        if (policy->ages && strncmp(p, "rate=", 5) == 0) {
+            if (parse_number(p + 5, &p, &params->aging_rate)) return NULL;
+        } else if (policy->ages && strncmp(p, "floor=", 6) == 0) {
+            if (parse_number(p + 6, &p, &params->aging_floor)) return NULL;
+        } else if (policy->feedback && strncmp(p, "levels=", 7) == 0) {
+            if (parse_number(p + 7, &p, &params->levels)) return NULL;
+            if (params->levels < 1 || params->levels > MLFQ_MAX_LEVELS) return NULL;
+        } else if (policy->feedback && strncmp(p, "boost=", 6) == 0) {
+            if (parse_number(p + 6, &p, &params->boost)) return NULL;
+        } else if (policy->quantum != SIZE_MAX) {
+            if (parse_number(p, &p, &params->quantum)) return NULL;
+            if (params->quantum == 0) return NULL;
+        } else {
+            return NULL;
+        }
+    }
+    if (*p != '\0') return NULL;
+    return policy;
 }
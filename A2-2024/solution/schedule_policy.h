@@ -1,12 +1,30 @@
 #pragma once
+#include <stddef.h>
 #include "queue.h"
 
+struct schedule_params;
+
 // A collection of functions that collectively implement the logic of a
 // scheduling policy. Requires a separate client to drive the action.
 struct schedule_policy {
-    // Run the given PCB. Return the given PCB if it should be re-scheduled,
-    // otherwise clean up the PCB and return NULL.
-    struct PCB *(*run_pcb)(struct PCB*);
+    const char *name;
+    // How many steps a process runs before it's preempted, unless the exec
+    // gives another quantum (RR:8, say). SIZE_MAX for a policy that runs
+    // each process to completion; those can't be given a quantum.
+    size_t quantum;
+    // Non-zero if the policy ages waiting processes, so that it can be
+    // given an aging rate and floor (see set_aging in queue.h).
+    int ages;
+    // Non-zero for a multi-level feedback policy, which can be given a
+    // number of levels and a boost period (see set_feedback in queue.h).
+    int feedback;
+    // How many steps pcb gets this time, if that isn't always the quantum.
+    // NULL otherwise.
+    size_t (*time_slice)(const struct schedule_params *params,
+                         const struct PCB *pcb);
+    // Allocate an empty queue of the kind the functions below work on.
+    // Free it with free_queue.
+    struct queue *(*alloc_queue)(void);
     // Enqueue the given PCB. If this policy is a priority queue (e.g. SJF),
     // the PCB may not end up at the tail of the queue.
     void (*enqueue)(struct queue*, struct PCB*);
@@ -18,10 +36,30 @@ struct schedule_policy {
     struct PCB *(*dequeue)(struct queue*);
 };
 
-const struct schedule_policy *get_policy(const char *policy_name);
+// What one exec asked of its policy. Each schedule has its own.
+struct schedule_params {
+    size_t quantum;
+    size_t aging_rate;
+    size_t aging_floor;
+    size_t levels;
+    size_t boost;
+};
+
+// Look up a policy, and the parameters given with it, written
+//   NAME[:QUANTUM][:rate=N][:floor=N][:levels=N][:boost=N]
+// e.g. RR, RR:8, AGING:1:rate=2 or MLFQ:4:levels=3. Anything not given is
+// the policy's default. Returns NULL if there's no such policy, or it can't
+// take the parameters given (a quantum of 0, or any quantum for FCFS, say).
+const struct schedule_policy *get_policy(const char *spec,
+                                         struct schedule_params *params);
+// The aging rate and floor used when an exec doesn't give them.
+// By default, 1 and 0.
+void set_default_aging(size_t rate, size_t floor);
 
 // Notes on particular policies:
 //
+// RR, RR30:
+//  The same policy, with default quanta of 2 and 30.
 // SJF:
 //  Ties are broken via FCFS.
 // Aging:
@@ -32,3 +70,13 @@ const struct schedule_policy *get_policy(const char *policy_name);
 //
 //  Otherwise (tie not at the head, or during first scheduling),
 //  we break ties with FCFS like SJF.
+//
+//  How fast waiting processes age, and how far, is set per exec
+//  (AGING:rate=2:floor=1), or for every exec with mysh's --aging-rate and
+//  --aging-floor.
+// MLFQ:
+//  Multi-level feedback queue; see queue.h. Level n's time slice is
+//  2^n quanta, so short jobs finish quickly on level 0, and long ones sink
+//  to where they get switched out less often. By default the quantum is 2,
+//  and the levels and boost period are MLFQ_DEFAULT_LEVELS (4) and
+//  MLFQ_DEFAULT_BOOST (200 steps).
@@ -1,15 +1,106 @@
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h> // isspace
 #include <string.h>
 #include <unistd.h> // isatty
 #include "shell.h"
+#include "code_cache.h"
+#include "command.h"
 #include "interpreter.h"
+#include "output.h"
+#include "schedule_policy.h"
 #include "shellmemory.h"
+#include "tokenizer.h"
+
+// Parse a byte count like 4096, 64K or 2M. Returns 0 on success.
+static int parse_size(const char *s, size_t *out) {
+    // strtoull would take "-1" (as the biggest size there is) and leading
+    // spaces; sizes are just digits.
+    if (*s < '0' || *s > '9') return -1;
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno == ERANGE || n > SIZE_MAX) return -1;
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0') return -1;
+    // Too big to be a size at all; don't let it wrap round to a small one.
+    if (n > (SIZE_MAX >> shift)) return -1;
+    *out = (size_t)n << shift;
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [--var-budget BYTES] "
+                    "[--shared-vars NAME [--shared-vars-size BYTES]] "
+                    "[--flush line|block|exit] [--ordered-output] "
+                    "[--code-cache DIR [--code-cache-size BYTES]] "
+                    "[--aging-rate N] [--aging-floor N]\n", argv0);
+    exit(1);
+}
 
 // Start of everything
 int main(int argc, char *argv[]) {
-    printf("Shell version 1.3 created September 2024\n\n");
+    // Runtime options. Each of these used to need a recompile.
+    //   --var-budget BYTES   cap the memory used by shell variables;
+    //                        `set` reports an error instead of growing past it.
+    //   --shared-vars NAME   keep variables in the shared memory segment NAME,
+    //                        shared with every other mysh using the same NAME.
+    //   --shared-vars-size BYTES
+    //                        size of that segment, if this mysh creates it.
+    //   --flush line|block|exit
+    //                        when output is written out; see output.h.
+    //   --ordered-output     print the output of MT processes in
+    //                        instruction order, so runs are reproducible.
+    //   --code-cache DIR     keep compiled scripts in DIR, so scripts that
+    //                        haven't changed aren't compiled again; see
+    //                        code_cache.h.
+    //   --code-cache-size BYTES
+    //                        how big DIR can get before old entries go.
+    //   --aging-rate N       how much AGING takes off the length of each
+    //                        waiting process per time slice (default 1),
+    //                        unless the exec says (AGING:rate=N).
+    //   --aging-floor N      how low aging can take it (default 0; or
+    //                        AGING:floor=N).
+    size_t var_budget = 0;
+    char *shared_vars = NULL;
+    size_t shared_vars_size = 16 << 20;
+    char *code_cache = NULL;
+    size_t code_cache_size = 16 << 20;
+    size_t aging_rate = 1;
+    size_t aging_floor = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--var-budget") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &var_budget)) usage(argv[0]);
+        } else if (strcmp(argv[i], "--shared-vars") == 0 && i + 1 < argc) {
+            shared_vars = argv[++i];
+        } else if (strcmp(argv[i], "--shared-vars-size") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &shared_vars_size)) usage(argv[0]);
+        } else if (strcmp(argv[i], "--flush") == 0 && i + 1 < argc) {
+            enum out_flush_policy policy;
+            if (out_parse_policy(argv[++i], &policy)) usage(argv[0]);
+            out_set_policy(policy);
+        } else if (strcmp(argv[i], "--ordered-output") == 0) {
+            out_set_ordered(1);
+        } else if (strcmp(argv[i], "--code-cache") == 0 && i + 1 < argc) {
+            code_cache = argv[++i];
+        } else if (strcmp(argv[i], "--code-cache-size") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &code_cache_size)) usage(argv[0]);
+        } else if (strcmp(argv[i], "--aging-rate") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &aging_rate)) usage(argv[0]);
+        } else if (strcmp(argv[i], "--aging-floor") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &aging_floor)) usage(argv[0]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    out_printf("Shell version 1.3 created September 2024\n\n");
 
     char prompt = '$';  				// Shell prompt
     char userInput[MAX_USER_INPUT];		// user's input stored here
@@ -24,9 +115,20 @@ int main(int argc, char *argv[]) {
     
     //init shell memory
     mem_init();
+    mem_set_budget(var_budget);
+    if (shared_vars) {
+        // shm_open wants a leading slash; don't make users type it.
+        char name[256];
+        snprintf(name, sizeof(name), "%s%s", shared_vars[0] == '/' ? "" : "/",
+                 shared_vars);
+        if (mem_attach_shared(name, shared_vars_size)) exit(1);
+    }
+    if (code_cache && code_cache_open(code_cache, code_cache_size)) exit(1);
+    set_default_aging(aging_rate, aging_floor);
     while(1) {
         if (!batch_mode) {
-            printf("%c ", prompt);
+            out_printf("%c ", prompt);
+            out_flush();
         }
         fgets(userInput, MAX_USER_INPUT-1, stdin);
         errorCode = parseInput(userInput);
@@ -43,67 +145,41 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
-int wordEnding(char c) {
-    // You may want to add ';' to this at some point,
-    // or you may want to find a different way to implement chains.
-    return c == '\0' || c == '\n' || isspace(c) || c == ';';
-}
-
 int parseInput(const char inp[]) {
-    char tmp[200], *words[100];                            
-    int ix = 0, w = 0;
-    int wordlen;
+    // Words are copied out of inp into scratch, rather than strdup'd one by
+    // one. inp is often a script line that other processes are running too,
+    // so we can't cut it up in place. scratch has room for any command: the
+    // tokenizer looks at most MAX_USER_INPUT characters into each one, and
+    // we keep at most MAX_ARGS_SIZE words, each followed by a NUL.
+    char scratch[MAX_USER_INPUT + MAX_ARGS_SIZE];
+    struct token tokens[MAX_ARGS_SIZE];
+    struct word words[MAX_ARGS_SIZE];
+    size_t pos = 0;
+    int chained;
     int errorCode = 0;
 
-    // This function probably isn't the best place to handle chains.
-    // That is, if we really wanted to implement relatively complex
-    // syntax like that of bash, we should really just tokenize everything,
-    // send the ';' as a separate word to the interpreter, and let the
-    // interpreter sort it out later.
-    // But for this simple shell, the interpreter's job is really only to be
-    // command dispatch, and this function is really acting as a complete
-    // parser rather than just a tokenizer. So we'll handle it here.
-
-    while (inp[ix] != '\n' && inp[ix] != '\0' && ix < 1000) {
-        // skip white spaces
-        for ( ; isspace(inp[ix]) && inp[ix] != '\n' && ix < 1000; ix++);
+    // Each command in a ';' chain is run in turn. (This used to recurse
+    // once per command; with scratch on the stack, a loop is kinder.)
+    do {
+        int w = tokenize_command(inp, &pos, tokens, MAX_ARGS_SIZE, &chained);
+        int kept = w < MAX_ARGS_SIZE ? w : MAX_ARGS_SIZE;
 
-        // If the next character is a semicolon,
-        // we should run what we have so far.
-        if (inp[ix] == ';') break;
-
-        // extract a word
-        for (wordlen = 0; !wordEnding(inp[ix]) && ix < 1000; ix++, wordlen++) {
-            tmp[wordlen] = inp[ix];
+        // The tokenizer has already moved pos past this command, but the
+        // tokens' offsets are relative to the start of inp.
+        char *next = scratch;
+        for (int i = 0; i < kept; ++i) {
+            memcpy(next, inp + tokens[i].offset, tokens[i].length);
+            next[tokens[i].length] = '\0';
+            make_word(&words[i], next, tokens[i].length);
+            next += tokens[i].length + 1;
         }
 
-        if (wordlen > 0) {
-            tmp[wordlen] = '\0';
-            words[w] = strdup(tmp);
-            w++;
-            if (inp[ix] == '\0') break;
-        } else {
-            break;
-        }
-    }
-    // In a real shell, we'd really want to ignore lines that don't
-    // contain any instructions. But the spec (particularly the blanklines test)
-    // insists that we instead print an error message.
-    // The "fix" to ignore those lines would be to uncomment this if.
-    //if (w > 0) {
+        // In a real shell, we'd really want to ignore lines that don't
+        // contain any instructions. But the spec (particularly the
+        // blanklines test) insists that we instead print an error message.
+        // The "fix" to ignore those lines would be to skip this when w == 0.
         errorCode = interpreter(words, w);
-        for (size_t i = 0; i < w; ++i) {
-            free(words[i]);
-        }
-    //}
-    if (inp[ix] == ';') {
-        // handle the next command in the chain by literally recursing
-        // the parser. We could equivalently wrap all of the work above
-        // in a while loop, but this makes it clearer what's going on.
-        // Additionally, a modern compiler is more than smart enough to
-        // turn this into a loop for us! Try adding -O2 to the CFLAGS in
-        // the Makefile and then read the assembly we get.
-        return parseInput(&inp[ix+1]);
-    }
+    } while (chained);
+
     return errorCode;
 }
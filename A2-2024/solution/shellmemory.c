@@ -1,8 +1,13 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h> // munmap
 #include "shellmemory.h"
+#include "slab.h"
+#include "shm_store.h"
 
 #define true 1
 #define false 0
@@ -15,11 +20,19 @@
 // removed from the line memory. Therefore, we can provide the line directly
 // to requests, rather than copying it. Freeing a program will free all of its
 // lines.
-// When a line is saved, it should be copied. This way, it can be saved from
-// a stack-allocated buffer without fear of losing it when the buffer is freed.
+//
+// A program's text is one contiguous blob of NUL-terminated lines, owned by
+// its extent (below), rather than one heap allocation per line. A line is
+// just an offset and length into that blob, so running a program walks
+// forward through one buffer instead of chasing pointers all over the heap,
+// and freeing a program is a single free() no matter how long it is.
+// To find the blob, a line records how far it is from the start of its
+// extent; that distance doesn't change when compaction moves the extent.
 struct program_line {
-    int allocated; // for sanity-checking
-    char *line;
+    uint32_t allocated; // for sanity-checking
+    uint32_t extent_offset;
+    uint32_t offset;
+    uint32_t length;
 };
 
 struct program_line linememory[MEM_SIZE];
@@ -28,51 +41,66 @@ struct program_line linememory[MEM_SIZE];
 //  1. Offer an API that lets the client allocate one line at a time.
 //  2. Offer an API that allocates whole programs at a time, and tracks their
 //      locations for being freed later.
-// (2) sounds harder, and it is, but that work needs to be done _somewhere_.
-// The description suggests that rather than doing it here, we can do it in
-// the PCB, so we'll do that. This will translate better to having page tables
-// in PCBs in part 3 so it's probably the more sensible approach.
-
-// Therefore, our API is to allocate one line at a time. Normally, we'd have
-// to worry about fragmentation and contiguity, but, we're supposed to allocate
-// everything before anything runs, and everything runs to completion before
-// any more commands can execute, AND there's no recursive run/exec.
-// All of that combined means we don't have to worry about fragmentation
-// at all: between invocations of run/exec, the linememory will be EMPTY!
+// (1) is simpler, and it's what we originally did: a bump pointer that was
+// reset at every top-level exec, relying on the linememory being empty at
+// that point. But a long background session (`exec ... #`) that keeps doing
+// nested execs never gets back to a top-level exec, so it ran out of lines
+// even when most of them had been freed long ago.
 //
-// Actually, there is one case of 'recursive' exec: the tests that look like
-//   exec .... #
-//   echo shell
-//   exec ....
-// The 'shell program' will recursively exec. The correct behavior in these
-// cases is to enqueue new program(s), not run them to completion immediately.
-// We're told we can assume that 1000 lines is enough to hold every program
-// that is being tested simultaneously, so we won't worry about the condition
-// that the linememory is empty once exec has been called with #.
-// At that point, the assumption tells us that there is enough memory left.
-
-size_t next_free_line = 0;
-// So we simply record the next free index in a variable.
-// We can't reset this whenever a PCB is freed, because we might be running
-// with # and the shell might be about to allocate another program and that
-// program might not fit in the first hole! So we provide a function to reset
-// this, which should be called whenever `exec` is called and we're not in
-// 'background mode.'
-void reset_linememory_allocator() {
-    next_free_line = 0;
-    assert_linememory_is_empty();
-}
-
-// The comments above detail an important, nontrivial invariant, that the
-// linememory is completely empty at certain times.
-// For sanity checking, we provide an additional function to assert that the
-// the linememory is empty.
+// So we do (2): linememory is managed as extents, contiguous ranges of lines.
+// A program gets its whole range in one call, and gives it back in one call.
+//  - Free space is kept as a list of free extents, sorted by position.
+//    Allocation is first-fit, and freeing an extent merges it with its
+//    neighbours, so free space doesn't get chopped up needlessly.
+//  - If there are enough free lines in total but no single free extent is
+//    big enough, the linememory is fragmented: we compact it by sliding all
+//    allocated extents down to the bottom, leaving one big free extent at
+//    the top.
+// Compaction moves programs, so the allocator needs to be able to tell their
+// owners where they went. The owner gives us a pointer to wherever it keeps
+// its base index, and we update it on a move. Only the linememory slots
+// move; the text they point into stays put, so a line that's in the middle
+// of being executed is unaffected.
+
+struct free_extent {
+    size_t base;
+    size_t count;
+};
+
+// At most every other line can be the start of a free extent, since
+// adjacent free extents are always merged.
+struct free_extent free_extents[MEM_SIZE / 2 + 1];
+size_t free_extent_count = 0;
+
+// For each allocated extent, indexed by its base: how long it is, where
+// its owner keeps its base, and the program text its lines point into.
+// count is 0 for lines that don't start an extent.
+// The text is either malloc'd or a private mmap of the script file; we need
+// to know which (and how big a mapping is) to release it.
+struct line_extent {
+    size_t count;
+    size_t *base_ref;
+    char *text;
+    size_t text_size;
+    int text_mapped;
+};
+
+struct line_extent extents[MEM_SIZE];
 
+// Number of allocated lines. This replaces sweeping the whole linememory
+// to check that it is empty.
+size_t lines_in_use = 0;
+
+// The comments in interpreter.c's my_exec rely on an important invariant:
+// that the linememory is completely empty at certain times.
+// For sanity checking, we provide a function to assert that the
+// the linememory is empty.
 void assert_linememory_is_empty() {
-    for (size_t i = 0; i < MEM_SIZE; ++i) {
-        assert(!linememory[i].allocated);
-        assert(linememory[i].line == NULL);
-    }
+    assert(lines_in_use == 0);
+}
+
+size_t linememory_in_use() {
+    return lines_in_use;
 }
 
 // note that init_linemem is not exposed from the header.
@@ -80,38 +108,181 @@ void assert_linememory_is_empty() {
 void init_linemem() {
     for (size_t i = 0; i < MEM_SIZE; ++i) {
         linememory[i].allocated = false;
-        linememory[i].line = NULL;
+        extents[i].count = 0;
+        extents[i].base_ref = NULL;
+        extents[i].text = NULL;
     }
+    free_extents[0].base = 0;
+    free_extents[0].count = MEM_SIZE;
+    free_extent_count = 1;
+    lines_in_use = 0;
+}
+
+// Remove free extent i from the list, or insert one at position i.
+static void remove_free_extent(size_t i) {
+    memmove(&free_extents[i], &free_extents[i + 1],
+            (free_extent_count - i - 1) * sizeof(struct free_extent));
+    free_extent_count--;
 }
 
-size_t allocate_line(const char *line) {
-    if (next_free_line >= MEM_SIZE) {
+static void insert_free_extent(size_t i, size_t base, size_t count) {
+    memmove(&free_extents[i + 1], &free_extents[i],
+            (free_extent_count - i) * sizeof(struct free_extent));
+    free_extents[i].base = base;
+    free_extents[i].count = count;
+    free_extent_count++;
+}
+
+// Slide every allocated extent down to the bottom of the linememory,
+// in order, so that all the free lines form one extent at the top.
+static void compact_linememory() {
+    size_t next = 0;
+    for (size_t base = 0; base < MEM_SIZE; ) {
+        size_t count = extents[base].count;
+        if (!count) {
+            base++;
+            continue;
+        }
+        if (base != next) {
+            memmove(&linememory[next], &linememory[base],
+                    count * sizeof(struct program_line));
+            extents[next] = extents[base];
+            extents[base].count = 0;
+            extents[base].base_ref = NULL;
+            extents[base].text = NULL;
+            // Clear the part of the old range the new one doesn't cover.
+            size_t clear_from = base > next + count ? base : next + count;
+            for (size_t i = clear_from; i < base + count; ++i) {
+                linememory[i].allocated = false;
+            }
+            *extents[next].base_ref = next;
+        }
+        next += count;
+        base += count;
+    }
+    free_extent_count = 0;
+    if (next < MEM_SIZE) {
+        insert_free_extent(0, next, MEM_SIZE - next);
+    }
+}
+
+static void release_text(char *text, size_t text_size, int text_mapped) {
+    if (text_mapped) {
+        munmap(text, text_size);
+    } else {
+        free(text);
+    }
+}
+
+int allocate_lines(size_t count, char *text, size_t text_size, int text_mapped,
+                   size_t *base_ref) {
+    if (count == 0) {
+        // Nothing to allocate, and nothing to free later.
+        if (text) release_text(text, text_size, text_mapped);
+        *base_ref = 0;
+        return 0;
+    }
+    if (count > MEM_SIZE - lines_in_use) {
         // out of memory!
-        return (size_t)(-1);
+        return -1;
+    }
+
+    // First fit. If nothing fits, there is enough space, it's just in
+    // pieces, so compact and then it definitely fits in the last extent.
+    size_t i = 0;
+    while (i < free_extent_count && free_extents[i].count < count) i++;
+    if (i == free_extent_count) {
+        compact_linememory();
+        i = 0;
+        assert(free_extent_count == 1 && free_extents[0].count >= count);
+    }
+
+    size_t base = free_extents[i].base;
+    if (free_extents[i].count == count) {
+        remove_free_extent(i);
+    } else {
+        free_extents[i].base += count;
+        free_extents[i].count -= count;
+    }
+
+    for (size_t ix = base; ix < base + count; ++ix) {
+        assert(!linememory[ix].allocated);
+        linememory[ix].allocated = true;
+        linememory[ix].extent_offset = ix - base;
+        linememory[ix].offset = 0;
+        linememory[ix].length = 0;
     }
-    size_t index = next_free_line++;
-    assert(!linememory[index].allocated);
+    extents[base].count = count;
+    extents[base].base_ref = base_ref;
+    extents[base].text = text;
+    extents[base].text_size = text_size;
+    extents[base].text_mapped = text_mapped;
+    *base_ref = base;
+    lines_in_use += count;
+    return 0;
+}
 
-    linememory[index].allocated = true;
-    // As described above, the allocator is only borrowing the string passed to it,
-    // but linememory must own all strings it contains, so we need to copy the
-    // string. (If you don't know what that means, see [Note: OBS].)
-    linememory[index].line = strdup(line);
-    return index;
+// linememory owns all the text it contains, so allocate_lines takes
+// ownership of the (malloc'd or mmap'd) text rather than borrowing it. (If you don't
+// know what that means, see [Note: OBS].) set_line just says where in the
+// text a line is.
+void set_line(size_t index, uint32_t offset, uint32_t length) {
+    assert(linememory[index].allocated);
+    linememory[index].offset = offset;
+    linememory[index].length = length;
 }
 
-// To free a line, we must deallocate it and adjust next_free.
-void free_line(size_t index) {
-    free(linememory[index].line);
-    linememory[index].allocated = false;
-    linememory[index].line = NULL;
+void free_lines(size_t base, size_t count) {
+    if (count == 0) return;
+    assert(extents[base].count == count);
+
+    for (size_t ix = base; ix < base + count; ++ix) {
+        linememory[ix].allocated = false;
+    }
+    release_text(extents[base].text, extents[base].text_size,
+                 extents[base].text_mapped);
+    extents[base].count = 0;
+    extents[base].base_ref = NULL;
+    extents[base].text = NULL;
+    lines_in_use -= count;
+
+    // Find where this extent goes in the sorted free list (binary search for
+    // the first free extent after it), then merge with its neighbours.
+    size_t lo = 0, hi = free_extent_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (free_extents[mid].base < base) lo = mid + 1;
+        else hi = mid;
+    }
+    int merge_prev = lo > 0
+        && free_extents[lo - 1].base + free_extents[lo - 1].count == base;
+    int merge_next = lo < free_extent_count
+        && base + count == free_extents[lo].base;
+
+    if (merge_prev && merge_next) {
+        free_extents[lo - 1].count += count + free_extents[lo].count;
+        remove_free_extent(lo);
+    } else if (merge_prev) {
+        free_extents[lo - 1].count += count;
+    } else if (merge_next) {
+        free_extents[lo].base = base;
+        free_extents[lo].count += count;
+    } else {
+        insert_free_extent(lo, base, count);
+    }
 }
 
 // Return a const pointer to ensure the caller doesn't do something horrific,
 // like try to free it.
 const char *get_line(size_t index) {
+    const struct program_line *line = &linememory[index];
+    assert(line->allocated);
+    return extents[index - line->extent_offset].text + line->offset;
+}
+
+size_t get_line_length(size_t index) {
     assert(linememory[index].allocated);
-    return linememory[index].line;
+    return linememory[index].length;
 }
 
 // [Note: OBS]
@@ -127,13 +298,102 @@ const char *get_line(size_t index) {
 // --------------------- 
 // Key-value memory for variables; from part 1.
 // ---------------------
+// In part 1, variables lived in a fixed array of MEM_SIZE entries and every
+// set/print/echo scanned the whole array with strcmp (twice, for a set of
+// a new variable!). Scripts do a _lot_ of variable operations, so that was
+// a full-table scan on every instruction.
+//
+// Instead, we keep the variables in a hash table. The table is split into
+// two parts, in the same way as CPython's dicts:
+//  1. `entries`, a dense array holding the actual (var, value) pairs.
+//  2. `index`, an open-addressing (linear probing) table of positions
+//      in `entries`.
+// Resizing only has to rebuild `index`; an entry keeps its position in
+// `entries` for as long as it exists. That means anything that remembers
+// an entry's position stays valid across a resize, which is handy for
+// handing out references later. Deleted entries are threaded onto a free
+// list and reused by the next insertion.
+//
+// The names and values themselves come from a slab allocator (slab.c)
+// owned by the store, rather than from strdup. Values are rounded up to a
+// size class, and overwriting a variable with a value that still fits
+// reuses the old storage in place, so a `set` of an existing variable
+// usually doesn't allocate at all.
+//
+// In MT mode, several worker threads interpret instructions at once, so
+// the store has to be safe to use concurrently. Rather than one big lock,
+// the store is split into NUM_SHARDS independent hash tables, each with
+// its own reader-writer lock; a variable lives in the shard picked by the
+// top bits of its hash. Threads touching different variables almost never
+// wait for each other, and readers of the same shard never wait for each
+// other at all. Each set/unset happens entirely under its shard's write
+// lock, so other threads see either the old value or the new one.
 
 struct memory_struct {
-    char *var;
+    char *var;    // NULL if this entry is on the free list
     char *value;
+    size_t value_length;
+    size_t value_capacity; // usable bytes at value, including the '\0'
+    size_t var_capacity;
+    size_t hash;
+    // Bumped every time this entry's value changes or the entry is removed.
+    // Borrowed views remember it so debug builds can catch stale views.
+    unsigned long generation;
+    // Which variable this entry holds, for mem_slot handles: a fresh one
+    // for every new variable, unlike generation, which a set also bumps.
+    uint32_t identity;
+    // Only meaningful while on the free list: next free entry, or -1.
+    long next_free;
 };
 
-struct memory_struct shellmemory[MEM_SIZE];
+// index slots hold a position in entries, or one of these.
+#define SLOT_EMPTY   (-1)
+#define SLOT_DELETED (-2)
+
+// The index is always a power of two in size, so we can mask instead of mod.
+#define MIN_INDEX_SIZE 64
+
+#define SHARD_BITS 4
+#define NUM_SHARDS (1 << SHARD_BITS)
+#define SHARD_SHIFT (sizeof(size_t) * 8 - SHARD_BITS)
+
+struct var_shard {
+    pthread_rwlock_t lock;
+
+    struct memory_struct *entries;
+    size_t entries_len;       // high-water mark of entries in use
+    size_t entries_capacity;
+    long free_entry;          // head of the entry free list
+
+    struct slab_allocator *strings;
+
+    long *index_table;
+    size_t index_size;
+    size_t index_live;        // slots holding an entry
+    size_t index_deleted;     // slots holding SLOT_DELETED
+};
+
+static struct var_shard shards[NUM_SHARDS];
+static int shards_initialized = false;
+
+// Nothing above is a fixed-size array any more, so the store grows for as
+// long as malloc keeps succeeding. A budget can be set at runtime (mysh's
+// --var-budget flag) to put a ceiling on it instead. It limits the bytes
+// occupied by names and values, as reported by mem_get_stats's bytes_in_use.
+// Zero means no limit.
+// bytes_in_use is shared by all shards, so it's only touched atomically.
+static size_t budget = 0;
+static size_t bytes_in_use = 0;
+
+// Optionally, the variables can live in shared memory instead, so several
+// mysh processes can use the same ones (see shm_store.c). The public
+// functions below hand off to it once it's attached. It has its own fixed
+// size, which acts as its budget.
+static int shared = false;
+
+// Source of memory_struct::identity. Shared by all shards, so a handle
+// can't mistake an entry of one shard for another's.
+static uint32_t next_identity = 0;
 
 // Helper functions
 int match(char *model, char *var) {
@@ -146,52 +406,427 @@ int match(char *model, char *var) {
     } else return 0;
 }
 
+// 64-bit FNV-1a. Variable names are short, so something fancier
+// wouldn't buy us anything.
+size_t mem_hash_var(const char *var) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (; *var; ++var) {
+        h ^= (unsigned char)*var;
+        h *= 1099511628211ULL;
+    }
+    return (size_t)h;
+}
+
+// The low bits of the hash pick the index slot, so use the high bits to
+// pick the shard. Otherwise every shard would only use 1/16 of its slots.
+static struct var_shard *shard_for(size_t hash) {
+    return &shards[hash >> SHARD_SHIFT];
+}
+
+// Find the index slot for var. If var is present, returns its slot.
+// Otherwise returns the slot where it should be inserted: the first deleted
+// slot on the probe sequence if there was one, else the empty slot that
+// terminated the probe.
+// The caller must hold the shard's lock (for reading is enough).
+static size_t find_slot(struct var_shard *sh, const char *var, size_t hash,
+                        int *found) {
+    size_t mask = sh->index_size - 1;
+    size_t i = hash & mask;
+    size_t insert_at = (size_t)(-1);
+
+    // The table is never allowed to fill up (see maybe_resize_index), so
+    // this loop always terminates at an empty slot.
+    for (;;) {
+        long slot = sh->index_table[i];
+        if (slot == SLOT_EMPTY) {
+            *found = false;
+            return insert_at != (size_t)(-1) ? insert_at : i;
+        }
+        if (slot == SLOT_DELETED) {
+            if (insert_at == (size_t)(-1)) insert_at = i;
+        } else if (sh->entries[slot].hash == hash
+                   && strcmp(sh->entries[slot].var, var) == 0) {
+            *found = true;
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+// Rebuild the index with the given size (a power of two), dropping any
+// deleted markers in the process.
+static void rebuild_index(struct var_shard *sh, size_t new_size) {
+    long *new_table = malloc(new_size * sizeof(long));
+    for (size_t i = 0; i < new_size; ++i) {
+        new_table[i] = SLOT_EMPTY;
+    }
+    size_t mask = new_size - 1;
+    for (size_t e = 0; e < sh->entries_len; ++e) {
+        if (!sh->entries[e].var) continue;
+        size_t i = sh->entries[e].hash & mask;
+        while (new_table[i] != SLOT_EMPTY) {
+            i = (i + 1) & mask;
+        }
+        new_table[i] = (long)e;
+    }
+    free(sh->index_table);
+    sh->index_table = new_table;
+    sh->index_size = new_size;
+    sh->index_deleted = 0;
+}
+
+// Keep the load factor (counting deleted markers, since they lengthen
+// probes just as much as live entries) at or below 3/4.
+// If the table is mostly deleted markers, rebuilding at the same size is
+// enough; otherwise double it.
+static void maybe_resize_index(struct var_shard *sh) {
+    if ((sh->index_live + sh->index_deleted + 1) * 4 <= sh->index_size * 3) return;
+    size_t new_size = sh->index_size;
+    while ((sh->index_live + 1) * 2 > new_size) {
+        new_size *= 2;
+    }
+    rebuild_index(sh, new_size);
+}
+
+// Copy str into storage from the shard's slab allocator.
+static char *slab_strdup(struct var_shard *sh, const char *str, size_t length,
+                         size_t *capacity) {
+    char *copy = slab_alloc(sh->strings, length + 1, capacity);
+    memcpy(copy, str, length + 1);
+    return copy;
+}
+
+// Take an entry off the free list, or from the end of the entries array.
+static long alloc_entry(struct var_shard *sh) {
+    if (sh->free_entry != -1) {
+        long e = sh->free_entry;
+        sh->free_entry = sh->entries[e].next_free;
+        return e;
+    }
+    if (sh->entries_len == sh->entries_capacity) {
+        sh->entries_capacity = sh->entries_capacity
+            ? 2 * sh->entries_capacity : MIN_INDEX_SIZE;
+        sh->entries = realloc(sh->entries,
+            sh->entries_capacity * sizeof(struct memory_struct));
+    }
+    return (long)sh->entries_len++;
+}
+
+// Account for names and values growing from old_bytes to new_bytes of
+// (size-class rounded) storage. Returns false, and changes nothing, if
+// that would go over budget. Several shards may be doing this at once,
+// so the check and the update are a single compare-and-swap.
+static int reserve_bytes(size_t old_bytes, size_t new_bytes) {
+    size_t current = __atomic_load_n(&bytes_in_use, __ATOMIC_RELAXED);
+    size_t updated;
+    do {
+        updated = current - old_bytes + new_bytes;
+        if (budget && new_bytes > old_bytes && updated > budget) return false;
+    } while (!__atomic_compare_exchange_n(&bytes_in_use, &current, updated,
+                                          true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return true;
+}
+
 // Shell memory functions
 
 void mem_init(){
-    int i;
-    for (i = 0; i < MEM_SIZE; i++) {		
-        // Include a character that's impossible to type so that
-        // we don't mistake an empty entry for an entry named 'none'.
-        shellmemory[i].var   = "none\1";
-        shellmemory[i].value = "none";
+    // mem_init is only called once, at startup, before any worker threads
+    // exist, but be tidy in case that ever changes. Destroying a shard's
+    // allocator releases every name and value in it at once.
+    for (size_t s = 0; s < NUM_SHARDS; ++s) {
+        struct var_shard *sh = &shards[s];
+        if (shards_initialized) {
+            slab_destroy(sh->strings);
+            free(sh->entries);
+            free(sh->index_table);
+            pthread_rwlock_destroy(&sh->lock);
+        }
+        pthread_rwlock_init(&sh->lock, NULL);
+        sh->strings = slab_create();
+        sh->entries = NULL;
+        sh->entries_len = sh->entries_capacity = 0;
+        sh->free_entry = -1;
+        sh->index_table = NULL;
+        sh->index_live = 0;
+        rebuild_index(sh, MIN_INDEX_SIZE);
     }
+    shards_initialized = true;
+    bytes_in_use = 0;
 
     init_linemem();
 }
 
+void mem_set_budget(size_t bytes) {
+    budget = bytes;
+}
+
+int mem_attach_shared(const char *name, size_t size) {
+    if (shm_store_attach(name, size)) return -1;
+    shared = true;
+    return 0;
+}
+
 // Set key value pair
-void mem_set_value(char *var_in, char *value_in) {
-    int i;
+int mem_set_value(char *var_in, char *value_in) {
+    size_t hash = mem_hash_var(var_in);
+    struct var_shard *sh = shard_for(hash);
+    size_t length = strlen(value_in);
+    int found;
+    int result = MEM_OK;
+
+    if (shared) return shm_store_set(var_in, value_in);
+
+    pthread_rwlock_wrlock(&sh->lock);
+    size_t i = find_slot(sh, var_in, hash, &found);
 
-    for (i = 0; i < MEM_SIZE; i++) {
-        if (strcmp(shellmemory[i].var, var_in) == 0) {
-            free(shellmemory[i].value);
-            shellmemory[i].value = strdup(value_in);
-            return;
-        } 
+    if (found) {
+        struct memory_struct *entry = &sh->entries[sh->index_table[i]];
+        // If it fits in the old value's slot, overwrite it in place.
+        // Unless it's _much_ smaller: then we'd rather give the big slot
+        // back than pin it down for a short value indefinitely.
+        if (length + 1 <= entry->value_capacity
+            && (length + 1) * 4 > entry->value_capacity) {
+            memcpy(entry->value, value_in, length + 1);
+            slab_resize_in_place(sh->strings, entry->value_length + 1, length + 1);
+        } else {
+            if (!reserve_bytes(entry->value_capacity,
+                               slab_capacity_for(length + 1))) {
+                result = MEM_ERR_BUDGET;
+                goto done;
+            }
+            slab_free(sh->strings, entry->value, entry->value_length + 1,
+                      entry->value_capacity);
+            entry->value = slab_strdup(sh, value_in, length,
+                                       &entry->value_capacity);
+        }
+        entry->value_length = length;
+        entry->generation++;
+        goto done;
     }
 
-    //Value does not exist, need to find a free spot.
-    for (i = 0; i < MEM_SIZE; i++) {
-        if (strcmp(shellmemory[i].var, "none\1") == 0) {
-            shellmemory[i].var   = strdup(var_in);
-            shellmemory[i].value = strdup(value_in);
-            return;
-        } 
+    //Value does not exist, need to make room for it.
+    if (!reserve_bytes(0, slab_capacity_for(strlen(var_in) + 1)
+                          + slab_capacity_for(length + 1))) {
+        result = MEM_ERR_BUDGET;
+        goto done;
     }
+    maybe_resize_index(sh);
+    // The resize may have moved everything around, so probe again.
+    i = find_slot(sh, var_in, hash, &found);
+    if (sh->index_table[i] == SLOT_DELETED) {
+        sh->index_deleted--;
+    }
+
+    long e = alloc_entry(sh);
+    struct memory_struct *entry = &sh->entries[e];
+    entry->value_length = length;
+    entry->var   = slab_strdup(sh, var_in, strlen(var_in), &entry->var_capacity);
+    entry->value = slab_strdup(sh, value_in, length, &entry->value_capacity);
+    entry->hash  = hash;
+    entry->identity = __atomic_add_fetch(&next_identity, 1, __ATOMIC_RELAXED);
+    // Don't reset generation: a recycled entry must not look like the
+    // entry a stale view was borrowed from.
+    entry->generation++;
+    sh->index_table[i] = e;
+    sh->index_live++;
 
-    return;
+done:
+    pthread_rwlock_unlock(&sh->lock);
+    return result;
 }
 
 //get value based on input key
 char *mem_get_value(char *var_in) {
-    int i;
+    size_t hash = mem_hash_var(var_in);
+    struct var_shard *sh = shard_for(hash);
+    char *value = NULL;
+    int found;
+
+    if (shared) {
+        struct mem_value_view view;
+        if (shm_store_borrow(var_in, &view)) {
+            value = strdup(view.value);
+            shm_store_return(&view);
+        }
+        return value;
+    }
+
+    pthread_rwlock_rdlock(&sh->lock);
+    size_t i = find_slot(sh, var_in, hash, &found);
+    if (found) {
+        value = strdup(sh->entries[sh->index_table[i]].value);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    return value;
+}
 
-    for (i = 0; i < MEM_SIZE; i++) {
-        if (strcmp(shellmemory[i].var, var_in) == 0){
-            return strdup(shellmemory[i].value);
-        } 
+// Borrow the value of var without copying it. An entry's value doesn't move
+// until the entry itself is changed, so the view stays valid until var is
+// set or unset again.
+// To make sure that doesn't happen while the view is in use, the shard's
+// read lock is held until mem_return_value. Other readers can still get in,
+// but a writer to the same shard will wait -- including this thread! So a
+// borrower must not set or unset variables before returning the view.
+int mem_borrow_value(const char *var_in, struct mem_value_view *view) {
+    return mem_borrow_value_hashed(var_in, mem_hash_var(var_in), view);
+}
+
+int mem_borrow_value_hashed(const char *var_in, size_t hash,
+                            struct mem_value_view *view) {
+    struct var_shard *sh = shard_for(hash);
+    int found;
+
+    if (shared) return shm_store_borrow(var_in, view);
+
+    pthread_rwlock_rdlock(&sh->lock);
+    size_t i = find_slot(sh, var_in, hash, &found);
+    if (!found) {
+        pthread_rwlock_unlock(&sh->lock);
+        view->value = NULL;
+        view->length = 0;
+        view->entry = -1;
+        return false;
+    }
+    long e = sh->index_table[i];
+    view->value = sh->entries[e].value;
+    view->length = sh->entries[e].value_length;
+    view->shard = (int)(sh - shards);
+    view->entry = e;
+    view->generation = sh->entries[e].generation;
+    return true;
+}
+
+// A slot's handle is the entry's index plus one (so that 0 means
+// unresolved) in the high half, and its identity in the low half. It's one
+// word so that threads sharing the slot can update it without tearing it.
+int mem_borrow_slot(struct mem_slot *slot, const char *var_in, size_t hash,
+                    struct mem_value_view *view) {
+    if (shared) return shm_store_borrow(var_in, view);
+
+    struct var_shard *sh = shard_for(hash);
+    uint64_t handle = __atomic_load_n(&slot->handle, __ATOMIC_RELAXED);
+    if (handle) {
+        size_t e = (handle >> 32) - 1;
+        pthread_rwlock_rdlock(&sh->lock);
+        // The entry may since have been unset, and maybe reused for some
+        // other variable; then its identity is different.
+        if (e < sh->entries_len && sh->entries[e].var
+            && sh->entries[e].identity == (uint32_t)handle
+            && sh->entries[e].hash == hash) {
+            view->value = sh->entries[e].value;
+            view->length = sh->entries[e].value_length;
+            view->shard = (int)(sh - shards);
+            view->entry = (long)e;
+            view->generation = sh->entries[e].generation;
+            return true;
+        }
+        pthread_rwlock_unlock(&sh->lock);
     }
-    return NULL;
-}
\ No newline at end of file
+
+    if (!mem_borrow_value_hashed(var_in, hash, view)) return false;
+    if (view->entry < UINT32_MAX) {
+        handle = ((uint64_t)(view->entry + 1) << 32)
+               | sh->entries[view->entry].identity;
+        __atomic_store_n(&slot->handle, handle, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+// Release the lock taken by mem_borrow_value. In debug builds, we also check
+// that the borrowed value wasn't changed underneath the borrower, which
+// would mean it read freed memory.
+void mem_return_value(struct mem_value_view *view) {
+    if (shared) {
+        shm_store_return(view);
+        return;
+    }
+    if (view->entry != -1) {
+        struct var_shard *sh = &shards[view->shard];
+        assert(sh->entries[view->entry].generation == view->generation);
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    view->value = NULL;
+    view->entry = -1;
+}
+
+// Remove a variable. Returns non-zero iff it existed.
+int mem_unset_value(char *var_in) {
+    size_t hash = mem_hash_var(var_in);
+    struct var_shard *sh = shard_for(hash);
+    int found;
+
+    if (shared) return shm_store_unset(var_in);
+
+    pthread_rwlock_wrlock(&sh->lock);
+    size_t i = find_slot(sh, var_in, hash, &found);
+    if (!found) {
+        pthread_rwlock_unlock(&sh->lock);
+        return false;
+    }
+
+    long e = sh->index_table[i];
+    struct memory_struct *entry = &sh->entries[e];
+    reserve_bytes(entry->var_capacity + entry->value_capacity, 0);
+    slab_free(sh->strings, entry->var, strlen(entry->var) + 1,
+              entry->var_capacity);
+    slab_free(sh->strings, entry->value, entry->value_length + 1,
+              entry->value_capacity);
+    entry->var = NULL;
+    entry->value = NULL;
+    entry->generation++;
+    entry->next_free = sh->free_entry;
+    sh->free_entry = e;
+
+    // We can't just empty the slot: that would cut the probe sequence
+    // for anything that was inserted after a collision with this entry.
+    sh->index_table[i] = SLOT_DELETED;
+    sh->index_live--;
+    sh->index_deleted++;
+    pthread_rwlock_unlock(&sh->lock);
+    return true;
+}
+
+// Number of variables currently set. If other threads are setting
+// variables at the same time, this is only a snapshot.
+size_t mem_variable_count() {
+    if (shared) return shm_store_count();
+    size_t count = 0;
+    for (size_t s = 0; s < NUM_SHARDS; ++s) {
+        pthread_rwlock_rdlock(&shards[s].lock);
+        count += shards[s].index_live;
+        pthread_rwlock_unlock(&shards[s].lock);
+    }
+    return count;
+}
+
+void mem_get_stats(struct mem_stats *stats) {
+    if (shared) {
+        shm_store_stats(stats);
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    for (size_t s = 0; s < NUM_SHARDS; ++s) {
+        struct var_shard *sh = &shards[s];
+        struct slab_stats slab;
+        pthread_rwlock_rdlock(&sh->lock);
+        slab_get_stats(sh->strings, &slab);
+        stats->variables += sh->index_live;
+        stats->table_bytes += sh->entries_capacity * sizeof(struct memory_struct)
+                            + sh->index_size * sizeof(long);
+        pthread_rwlock_unlock(&sh->lock);
+
+        stats->bytes_requested += slab.bytes_requested;
+        stats->bytes_in_use += slab.bytes_in_use + slab.large_bytes;
+        stats->bytes_reserved += slab.bytes_reserved + slab.large_bytes;
+        stats->slab_count += slab.slab_count;
+    }
+
+    // Internal: space lost to rounding up to a size class.
+    stats->internal_fragmentation = stats->bytes_in_use
+        ? 1.0 - (double)stats->bytes_requested / stats->bytes_in_use : 0.0;
+    // External: reserved space that isn't handed out, i.e. free objects
+    // plus the not-yet-carved tails of slabs.
+    stats->external_fragmentation = stats->bytes_reserved
+        ? 1.0 - (double)stats->bytes_in_use / stats->bytes_reserved : 0.0;
+}
@@ -1,11 +1,96 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// The number of program lines linememory can hold. Benchmarks that load
+// huge scripts build with a bigger one.
+#ifndef MEM_SIZE
 #define MEM_SIZE 1000
+#endif
 
 void assert_linememory_is_empty(void);
-size_t allocate_line(const char *line);
-void free_line(size_t index);
+size_t linememory_in_use(void);
+// Allocate count contiguous lines for a program whose text is the blob
+// text, text_size bytes long; linememory takes ownership of it. The blob is
+// malloc'd, or if text_mapped, a private mmap of the script.
+// Stores the first index in *base_ref and returns 0, or returns -1 (and
+// doesn't take text) if there isn't room. The linememory may later be
+// compacted, which moves the lines and updates *base_ref to match, so
+// base_ref must stay valid until the lines are freed.
+int allocate_lines(size_t count, char *text, size_t text_size, int text_mapped,
+                   size_t *base_ref);
+// Say where an allocated line's NUL-terminated text is within its program's
+// blob.
+void set_line(size_t index, uint32_t offset, uint32_t length);
+// Frees the lines and the program text, all at once.
+void free_lines(size_t base, size_t count);
 const char *get_line(size_t index);
-void reset_linememory_allocator(void);
+size_t get_line_length(size_t index);
+
+// A borrowed, read-only view of a variable's value. It stays valid until
+// that variable is next set or unset; don't free it.
+// Other threads are kept from changing the variable until the view is
+// returned, so return it promptly, and don't set or unset variables
+// while holding one.
+struct mem_value_view {
+    const char *value;
+    size_t length;
+    // Where the value lives, so mem_return_value can release it and (in
+    // debug builds) check that it didn't go stale.
+    int shard;
+    long entry;
+    unsigned long generation;
+};
+
+// Memory usage of the variable store. Byte counts cover the names and
+// values; table_bytes is the hash table itself.
+struct mem_stats {
+    size_t variables;
+    size_t bytes_requested; // what the strings actually need
+    size_t bytes_in_use;    // what they occupy after size-class rounding
+    size_t bytes_reserved;  // what the store has obtained from malloc
+    size_t table_bytes;
+    size_t slab_count;
+    double internal_fragmentation; // 1 - requested / in_use
+    double external_fragmentation; // 1 - in_use / reserved
+};
 
 void mem_init();
 char *mem_get_value(char *var);
-void mem_set_value(char *var, char *value);
+// Result codes for mem_set_value.
+#define MEM_OK 0
+#define MEM_ERR_BUDGET 1 // the variable store's budget would be exceeded
+
+// The store grows as needed. A budget of zero (the default) means no limit.
+void mem_set_budget(size_t bytes);
+int mem_set_value(char *var, char *value);
+int mem_unset_value(char *var);
+// Returns non-zero and fills view iff var exists. Every successful borrow
+// should be paired with mem_return_value once the caller is done.
+int mem_borrow_value(const char *var, struct mem_value_view *view);
+// The same, for a caller that already knows mem_hash_var(var).
+int mem_borrow_value_hashed(const char *var, size_t hash,
+                            struct mem_value_view *view);
+void mem_return_value(struct mem_value_view *view);
+
+// A remembered lookup, for code that looks the same variable up again and
+// again, like a compiled script. The first borrow through a slot finds the
+// variable by name, as usual; later ones go straight to where it was, so
+// long as it hasn't been unset since. Slots start out zeroed.
+struct mem_slot {
+    uint64_t handle;
+};
+// Like mem_borrow_value_hashed, but through a slot, which is always for
+// the same var. Several threads can use one slot at once.
+int mem_borrow_slot(struct mem_slot *slot, const char *var, size_t hash,
+                    struct mem_value_view *view);
+void mem_get_stats(struct mem_stats *stats);
+// Move the variables into the POSIX shared memory segment called name
+// (which must start with '/'), creating it with the given size if no other
+// mysh has yet. Returns 0 on success. Call before any variables are set;
+// variables set earlier stay behind in private memory.
+int mem_attach_shared(const char *name, size_t size);
+// The hash function used for variable names. Shared-memory stores rely on
+// every process agreeing on it.
+size_t mem_hash_var(const char *var);
+size_t mem_variable_count();
@@ -0,0 +1,504 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>    // O_* constants
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h> // shm_open, mmap
+#include <sys/stat.h>
+#include <unistd.h>   // ftruncate, usleep
+#include "shm_store.h"
+
+#define true 1
+#define false 0
+
+// Segment layout:
+//
+//   struct shm_header   (including one struct shm_shard per shard)
+//   shard 0 region:     slot table, then heap for names and values
+//   shard 1 region:     ...
+//
+// As in the private store, variables are spread over shards by the top
+// bits of their hash, and each shard has its own lock. Each shard is an
+// open-addressing table with linear probing. Names and values are stored
+// in the shard's heap, which hands out power-of-two size classes from a
+// bump pointer and reuses freed blocks through per-class free lists.
+// The free list links are offsets stored in the free blocks themselves.
+
+#define SHM_MAGIC 0x6d797368766172ULL // "myshvar"
+#define SHM_VERSION 1
+
+#define SHM_SHARD_BITS 4
+#define SHM_SHARDS (1 << SHM_SHARD_BITS)
+
+#define SHM_MIN_CLASS_SHIFT 4
+#define SHM_CLASSES 9 // 16 bytes .. 4KiB
+#define SHM_MAX_CLASS_SIZE ((size_t)1 << (SHM_MIN_CLASS_SHIFT + SHM_CLASSES - 1))
+
+#define SLOT_EMPTY   0
+#define SLOT_LIVE    1
+#define SLOT_DELETED 2
+
+struct shm_slot {
+    uint64_t hash;
+    uint64_t generation;
+    uint32_t var;            // offsets into the segment
+    uint32_t value;
+    uint32_t value_length;
+    uint32_t value_capacity;
+    uint32_t var_capacity;
+    uint32_t state;
+};
+
+struct shm_shard {
+    pthread_rwlock_t lock;   // initialised PTHREAD_PROCESS_SHARED
+    uint64_t slots;          // offset of the slot table
+    uint64_t slot_count;     // a power of two
+    uint64_t live;
+    uint64_t deleted;
+    uint64_t heap_top;       // next unused heap byte
+    uint64_t heap_end;
+    uint64_t free_lists[SHM_CLASSES];
+    uint64_t bytes_requested;
+    uint64_t bytes_in_use;
+};
+
+struct shm_header {
+    // Written last by the creating process, so a process that attaches
+    // while the segment is still being set up can wait for it.
+    uint64_t magic;
+    uint32_t version;
+    uint32_t shard_count;
+    uint64_t size;
+    struct shm_shard shards[SHM_SHARDS];
+};
+
+static char *base = NULL;
+static struct shm_header *header = NULL;
+
+#define AT(offset) ((void *)(base + (offset)))
+
+static struct shm_shard *shard_for(uint64_t hash) {
+    return &header->shards[hash >> (64 - SHM_SHARD_BITS)];
+}
+
+static struct shm_slot *slots_of(struct shm_shard *sh) {
+    return AT(sh->slots);
+}
+
+// ---------------------
+// Heap
+// ---------------------
+
+static int class_of(size_t size) {
+    int c = 0;
+    while (((size_t)1 << (SHM_MIN_CLASS_SHIFT + c)) < size) c++;
+    return c;
+}
+
+// Returns the offset of a block of at least size bytes, or 0 if the shard's
+// heap is exhausted.
+static uint32_t heap_alloc(struct shm_shard *sh, size_t size, uint32_t *capacity) {
+    if (size > SHM_MAX_CLASS_SIZE) return 0;
+    int c = class_of(size);
+    size_t csize = (size_t)1 << (SHM_MIN_CLASS_SHIFT + c);
+    uint64_t offset;
+
+    if (sh->free_lists[c]) {
+        offset = sh->free_lists[c];
+        sh->free_lists[c] = *(uint64_t *)AT(offset);
+    } else {
+        if (sh->heap_top + csize > sh->heap_end) return 0;
+        offset = sh->heap_top;
+        sh->heap_top += csize;
+    }
+    sh->bytes_in_use += csize;
+    sh->bytes_requested += size;
+    *capacity = csize;
+    return (uint32_t)offset;
+}
+
+static void heap_free(struct shm_shard *sh, uint32_t offset, size_t size,
+                      uint32_t capacity) {
+    int c = class_of(capacity);
+    *(uint64_t *)AT(offset) = sh->free_lists[c];
+    sh->free_lists[c] = offset;
+    sh->bytes_in_use -= capacity;
+    sh->bytes_requested -= size;
+}
+
+// ---------------------
+// Slot table
+// ---------------------
+
+// Same contract as find_slot in shellmemory.c: the slot holding var, or the
+// slot it should be inserted in.
+static size_t find_slot(struct shm_shard *sh, const char *var, uint64_t hash,
+                        int *found) {
+    struct shm_slot *slots = slots_of(sh);
+    size_t mask = sh->slot_count - 1;
+    size_t i = hash & mask;
+    size_t insert_at = (size_t)(-1);
+
+    for (;;) {
+        struct shm_slot *slot = &slots[i];
+        if (slot->state == SLOT_EMPTY) {
+            *found = false;
+            return insert_at != (size_t)(-1) ? insert_at : i;
+        }
+        if (slot->state == SLOT_DELETED) {
+            if (insert_at == (size_t)(-1)) insert_at = i;
+        } else if (slot->hash == hash && strcmp(AT(slot->var), var) == 0) {
+            *found = true;
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+// The table can't grow: other processes have it mapped. When deleted
+// markers pile up, rehash it in place instead.
+static void rehash_in_place(struct shm_shard *sh) {
+    struct shm_slot *slots = slots_of(sh);
+    struct shm_slot *live = malloc(sh->live * sizeof(struct shm_slot));
+    size_t n = 0;
+    for (size_t i = 0; i < sh->slot_count; ++i) {
+        if (slots[i].state == SLOT_LIVE) live[n++] = slots[i];
+    }
+    memset(slots, 0, sh->slot_count * sizeof(struct shm_slot));
+    size_t mask = sh->slot_count - 1;
+    for (size_t k = 0; k < n; ++k) {
+        size_t i = live[k].hash & mask;
+        while (slots[i].state != SLOT_EMPTY) i = (i + 1) & mask;
+        slots[i] = live[k];
+    }
+    sh->deleted = 0;
+    free(live);
+}
+
+// Make sure there's room to insert one more entry at load factor <= 3/4.
+static int reserve_slot(struct shm_shard *sh) {
+    if ((sh->live + sh->deleted + 1) * 4 <= sh->slot_count * 3) return true;
+    if ((sh->live + 1) * 4 > sh->slot_count * 3) return false;
+    rehash_in_place(sh);
+    return true;
+}
+
+// ---------------------
+// Setup
+// ---------------------
+
+static void init_segment(size_t size) {
+    memset(header, 0, sizeof(struct shm_header));
+    header->version = SHM_VERSION;
+    header->shard_count = SHM_SHARDS;
+    header->size = size;
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+
+    // Split what's left after the header evenly. In each shard, roughly a
+    // quarter of the space goes to slots and the rest to the heap.
+    size_t first = (sizeof(struct shm_header) + 63) & ~(size_t)63;
+    size_t region = ((size - first) / SHM_SHARDS) & ~(size_t)63;
+    for (int s = 0; s < SHM_SHARDS; ++s) {
+        struct shm_shard *sh = &header->shards[s];
+        uint64_t start = first + s * region;
+        size_t count = 1;
+        while (count * 2 * sizeof(struct shm_slot) <= region / 4) count *= 2;
+
+        pthread_rwlock_init(&sh->lock, &attr);
+        sh->slots = start;
+        sh->slot_count = count;
+        // The heap starts after the slots, so a heap offset is never 0
+        // and heap_alloc can use 0 to mean failure.
+        sh->heap_top = start + count * sizeof(struct shm_slot);
+        sh->heap_end = start + region;
+        memset(AT(sh->slots), 0, count * sizeof(struct shm_slot));
+    }
+    pthread_rwlockattr_destroy(&attr);
+
+    // Publish: everything above must be visible before the magic is.
+    __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+// How long to wait for another process to finish creating the segment
+// before deciding it never will: it died part way, or rejected its size
+// and unlinked the segment from under us.
+#define SHM_ATTACH_TIMEOUT_MS 5000
+
+// Whether fd is still the segment called name, rather than one that's
+// since been unlinked (and maybe replaced by a new one).
+static int still_named(const char *name, int fd) {
+    int current = shm_open(name, O_RDWR, 0600);
+    if (current == -1) return false;
+    struct stat ours, named;
+    int same = fstat(fd, &ours) == 0 && fstat(current, &named) == 0
+            && ours.st_dev == named.st_dev && ours.st_ino == named.st_ino;
+    close(current);
+    return same;
+}
+
+// Our segment's creator never finished setting it up. If it's still there
+// under name, unlink it, so the next attempt creates a fresh one.
+static void abandon(const char *name, int fd) {
+    if (still_named(name, fd)) {
+        fprintf(stderr, "shared variable segment %s was never initialised; "
+                        "recreating it\n", name);
+        shm_unlink(name);
+    }
+}
+
+// Returns 0 once attached, -1 on error, or 1 if the segment's creator
+// didn't finish with it in time, in which case it's worth trying again.
+static int attach_once(const char *name, size_t size) {
+    // Exactly one process gets to create (and initialise) the segment.
+    int creator = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        creator = false;
+        fd = shm_open(name, O_RDWR, 0600);
+        // It went away in between; start over.
+        if (fd == -1 && errno == ENOENT) return 1;
+    }
+    if (fd == -1) {
+        perror("shm_open");
+        return -1;
+    }
+
+    if (creator) {
+        // Offsets in slots are 32 bits. (size is ignored when attaching
+        // to an existing segment, so only check it here.)
+        size_t min_size = sizeof(struct shm_header) + SHM_SHARDS * 4096;
+        if (size < min_size || size > UINT32_MAX) {
+            fprintf(stderr, "shared variable segment size must be between "
+                            "%zu and %u bytes\n", min_size, UINT32_MAX);
+            close(fd);
+            shm_unlink(name);
+            return -1;
+        }
+        if (ftruncate(fd, size) == -1) {
+            perror("ftruncate");
+            close(fd);
+            shm_unlink(name);
+            return -1;
+        }
+    } else {
+        // The creator may not have sized it yet; wait until it has.
+        struct stat st;
+        int waited = 0;
+        while (fstat(fd, &st) == 0 && st.st_size == 0) {
+            if (waited++ == SHM_ATTACH_TIMEOUT_MS) {
+                abandon(name, fd);
+                close(fd);
+                return 1;
+            }
+            usleep(1000);
+        }
+        size = st.st_size;
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        base = NULL;
+        return -1;
+    }
+    header = (struct shm_header *)base;
+
+    if (creator) {
+        close(fd); // the mapping keeps the segment alive
+        init_segment(size);
+        return 0;
+    }
+
+    int waited = 0;
+    while (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        if (waited++ == SHM_ATTACH_TIMEOUT_MS) {
+            abandon(name, fd);
+            break;
+        }
+        usleep(1000);
+    }
+    close(fd);
+    if (header->magic != SHM_MAGIC || header->version != SHM_VERSION
+        || header->shard_count != SHM_SHARDS) {
+        if (header->magic == SHM_MAGIC) {
+            fprintf(stderr, "shared variable segment %s has an incompatible layout\n", name);
+        }
+        int retry = header->magic != SHM_MAGIC;
+        munmap(base, size);
+        base = NULL;
+        header = NULL;
+        return retry ? 1 : -1;
+    }
+    return 0;
+}
+
+int shm_store_attach(const char *name, size_t size) {
+    // One retry: a stale segment is gone after the first attempt, so a
+    // second timeout means something else is wrong.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        int result = attach_once(name, size);
+        if (result != 1) return result;
+    }
+    fprintf(stderr, "timed out attaching to shared variable segment %s\n", name);
+    return -1;
+}
+
+// ---------------------
+// Store operations; see the matching mem_* functions in shellmemory.c.
+// ---------------------
+
+int shm_store_set(const char *var, const char *value) {
+    uint64_t hash = mem_hash_var(var);
+    struct shm_shard *sh = shard_for(hash);
+    size_t length = strlen(value);
+    int found;
+    int result = MEM_OK;
+
+    pthread_rwlock_wrlock(&sh->lock);
+    size_t i = find_slot(sh, var, hash, &found);
+    struct shm_slot *slot = &slots_of(sh)[i];
+
+    if (found) {
+        if (length + 1 <= slot->value_capacity) {
+            sh->bytes_requested += length;
+            sh->bytes_requested -= slot->value_length;
+        } else {
+            uint32_t capacity;
+            uint32_t offset = heap_alloc(sh, length + 1, &capacity);
+            if (!offset) {
+                result = MEM_ERR_BUDGET;
+                goto done;
+            }
+            heap_free(sh, slot->value, slot->value_length + 1, slot->value_capacity);
+            slot->value = offset;
+            slot->value_capacity = capacity;
+        }
+        memcpy(AT(slot->value), value, length + 1);
+        slot->value_length = length;
+        slot->generation++;
+        goto done;
+    }
+
+    size_t var_length = strlen(var);
+    uint32_t var_capacity, value_capacity;
+    uint32_t var_offset, value_offset = 0;
+    if (!reserve_slot(sh)
+        || !(var_offset = heap_alloc(sh, var_length + 1, &var_capacity))) {
+        result = MEM_ERR_BUDGET;
+        goto done;
+    }
+    if (!(value_offset = heap_alloc(sh, length + 1, &value_capacity))) {
+        heap_free(sh, var_offset, var_length + 1, var_capacity);
+        result = MEM_ERR_BUDGET;
+        goto done;
+    }
+    // reserve_slot may have rehashed.
+    i = find_slot(sh, var, hash, &found);
+    slot = &slots_of(sh)[i];
+    if (slot->state == SLOT_DELETED) sh->deleted--;
+
+    memcpy(AT(var_offset), var, var_length + 1);
+    memcpy(AT(value_offset), value, length + 1);
+    slot->hash = hash;
+    slot->var = var_offset;
+    slot->var_capacity = var_capacity;
+    slot->value = value_offset;
+    slot->value_capacity = value_capacity;
+    slot->value_length = length;
+    slot->generation++;
+    slot->state = SLOT_LIVE;
+    sh->live++;
+
+done:
+    pthread_rwlock_unlock(&sh->lock);
+    return result;
+}
+
+int shm_store_unset(const char *var) {
+    uint64_t hash = mem_hash_var(var);
+    struct shm_shard *sh = shard_for(hash);
+    int found;
+
+    pthread_rwlock_wrlock(&sh->lock);
+    size_t i = find_slot(sh, var, hash, &found);
+    if (found) {
+        struct shm_slot *slot = &slots_of(sh)[i];
+        heap_free(sh, slot->var, strlen(AT(slot->var)) + 1, slot->var_capacity);
+        heap_free(sh, slot->value, slot->value_length + 1, slot->value_capacity);
+        slot->generation++;
+        slot->state = SLOT_DELETED;
+        sh->live--;
+        sh->deleted++;
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    return found;
+}
+
+int shm_store_borrow(const char *var, struct mem_value_view *view) {
+    uint64_t hash = mem_hash_var(var);
+    struct shm_shard *sh = shard_for(hash);
+    int found;
+
+    pthread_rwlock_rdlock(&sh->lock);
+    size_t i = find_slot(sh, var, hash, &found);
+    if (!found) {
+        pthread_rwlock_unlock(&sh->lock);
+        view->value = NULL;
+        view->length = 0;
+        view->entry = -1;
+        return false;
+    }
+    struct shm_slot *slot = &slots_of(sh)[i];
+    view->value = AT(slot->value);
+    view->length = slot->value_length;
+    view->shard = (int)(sh - header->shards);
+    view->entry = (long)i;
+    view->generation = slot->generation;
+    return true;
+}
+
+void shm_store_return(struct mem_value_view *view) {
+    if (view->entry != -1) {
+        struct shm_shard *sh = &header->shards[view->shard];
+        assert(slots_of(sh)[view->entry].generation == view->generation);
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    view->value = NULL;
+    view->entry = -1;
+}
+
+size_t shm_store_count() {
+    size_t count = 0;
+    for (int s = 0; s < SHM_SHARDS; ++s) {
+        struct shm_shard *sh = &header->shards[s];
+        pthread_rwlock_rdlock(&sh->lock);
+        count += sh->live;
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    return count;
+}
+
+void shm_store_stats(struct mem_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int s = 0; s < SHM_SHARDS; ++s) {
+        struct shm_shard *sh = &header->shards[s];
+        pthread_rwlock_rdlock(&sh->lock);
+        stats->variables += sh->live;
+        stats->bytes_requested += sh->bytes_requested;
+        stats->bytes_in_use += sh->bytes_in_use;
+        stats->bytes_reserved += sh->heap_end - (sh->slots + sh->slot_count * sizeof(struct shm_slot));
+        stats->table_bytes += sh->slot_count * sizeof(struct shm_slot);
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    stats->internal_fragmentation = stats->bytes_in_use
+        ? 1.0 - (double)stats->bytes_requested / stats->bytes_in_use : 0.0;
+    stats->external_fragmentation = stats->bytes_reserved
+        ? 1.0 - (double)stats->bytes_in_use / stats->bytes_reserved : 0.0;
+}
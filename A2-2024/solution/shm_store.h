@@ -0,0 +1,28 @@
+#pragma once
+#include <stddef.h>
+#include "shellmemory.h"
+
+// A variable store that lives in a POSIX shared memory segment, so that
+// several mysh processes attached to the same segment see the same
+// variables. shellmemory.c switches over to it when mem_attach_shared is
+// called; nothing else should need to call these directly.
+//
+// Everything in the segment is addressed by offsets rather than pointers,
+// because every process maps it at a different address, and it is guarded
+// by process-shared reader-writer locks. The segment is fixed in size once
+// created: when it fills up, writes fail with MEM_ERR_BUDGET.
+
+// Attach to the segment called name, creating it with the given size if it
+// doesn't exist yet. Attaching to an existing segment only maps it; there's
+// nothing to parse or reload. If the segment's creator doesn't finish
+// setting it up within a few seconds, the segment is taken to be stale,
+// unlinked and created afresh. Returns 0 on success, -1 (with a message on
+// stderr) on failure.
+int shm_store_attach(const char *name, size_t size);
+
+int shm_store_set(const char *var, const char *value);
+int shm_store_unset(const char *var);
+int shm_store_borrow(const char *var, struct mem_value_view *view);
+void shm_store_return(struct mem_value_view *view);
+size_t shm_store_count();
+void shm_store_stats(struct mem_stats *stats);
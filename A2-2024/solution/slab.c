@@ -0,0 +1,150 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "slab.h"
+
+// Size classes are 16, 32, ..., 2048 bytes. Typed values are capped at
+// MAX_USER_INPUT characters by the parser, so most land in a class; the
+// malloc fallback takes the rest (e.g. a set of several long $vars).
+#define MIN_CLASS_SHIFT 4
+#define NUM_CLASSES 8
+#define MAX_CLASS_SIZE ((size_t)1 << (MIN_CLASS_SHIFT + NUM_CLASSES - 1))
+
+// Every slab is the same size regardless of class. 16KiB holds 1023 of the
+// smallest objects and 7 of the largest. (The variable store has one
+// allocator per shard, so bigger slabs would reserve a lot up front.)
+#define SLAB_SIZE (16 * 1024)
+
+// Free objects store the free list link in their own first bytes.
+struct free_object {
+    struct free_object *next;
+};
+
+struct slab {
+    struct slab *next;
+    // objects follow; the header is padded so they stay 16-byte aligned.
+};
+#define SLAB_HEADER 16
+
+struct size_class {
+    struct free_object *free_list;
+    // Objects not yet carved from the newest slab. Handing them out lazily
+    // means a fresh slab doesn't need to be threaded onto the free list.
+    char *bump;
+    char *bump_end;
+};
+
+struct slab_allocator {
+    struct size_class classes[NUM_CLASSES];
+    struct slab *slabs;
+    struct slab_stats stats;
+};
+
+static int size_class_of(size_t size) {
+    int c = 0;
+    size_t class_size = (size_t)1 << MIN_CLASS_SHIFT;
+    while (class_size < size) {
+        class_size <<= 1;
+        c++;
+    }
+    return c;
+}
+
+static size_t class_size(int c) {
+    return (size_t)1 << (MIN_CLASS_SHIFT + c);
+}
+
+struct slab_allocator *slab_create() {
+    struct slab_allocator *a = calloc(1, sizeof(struct slab_allocator));
+    return a;
+}
+
+void slab_destroy(struct slab_allocator *a) {
+    if (!a) return;
+    struct slab *s = a->slabs;
+    while (s) {
+        struct slab *next = s->next;
+        free(s);
+        s = next;
+    }
+    free(a);
+}
+
+static void refill(struct slab_allocator *a, struct size_class *sc) {
+    struct slab *s = malloc(SLAB_SIZE);
+    s->next = a->slabs;
+    a->slabs = s;
+    sc->bump = (char *)s + SLAB_HEADER;
+    sc->bump_end = (char *)s + SLAB_SIZE;
+    a->stats.slab_count++;
+    a->stats.bytes_reserved += SLAB_SIZE;
+}
+
+void *slab_alloc(struct slab_allocator *a, size_t size, size_t *capacity) {
+    a->stats.bytes_requested += size;
+
+    if (size > MAX_CLASS_SIZE) {
+        a->stats.large_count++;
+        a->stats.large_bytes += size;
+        if (capacity) *capacity = size;
+        return malloc(size);
+    }
+
+    int c = size_class_of(size);
+    size_t csize = class_size(c);
+    struct size_class *sc = &a->classes[c];
+    void *p;
+
+    if (sc->free_list) {
+        p = sc->free_list;
+        sc->free_list = sc->free_list->next;
+        a->stats.bytes_free -= csize;
+    } else {
+        if (sc->bump + csize > sc->bump_end) {
+            // Whatever is left at the end of the old slab is wasted, but it
+            // is always less than one object of this class.
+            refill(a, sc);
+        }
+        p = sc->bump;
+        sc->bump += csize;
+    }
+
+    a->stats.bytes_in_use += csize;
+    if (capacity) *capacity = csize;
+    return p;
+}
+
+void slab_free(struct slab_allocator *a, void *p, size_t size, size_t capacity) {
+    if (!p) return;
+    a->stats.bytes_requested -= size;
+
+    if (capacity > MAX_CLASS_SIZE) {
+        a->stats.large_count--;
+        // By capacity, not size: the block may have been reused in place
+        // for a smaller value since (see slab_resize_in_place).
+        a->stats.large_bytes -= capacity;
+        free(p);
+        return;
+    }
+
+    int c = size_class_of(capacity);
+    assert(class_size(c) == capacity);
+    struct free_object *o = p;
+    o->next = a->classes[c].free_list;
+    a->classes[c].free_list = o;
+    a->stats.bytes_in_use -= capacity;
+    a->stats.bytes_free += capacity;
+}
+
+void slab_resize_in_place(struct slab_allocator *a, size_t old_size, size_t size) {
+    a->stats.bytes_requested += size;
+    a->stats.bytes_requested -= old_size;
+}
+
+size_t slab_capacity_for(size_t size) {
+    if (size > MAX_CLASS_SIZE) return size;
+    return class_size(size_class_of(size));
+}
+
+void slab_get_stats(struct slab_allocator *a, struct slab_stats *stats) {
+    *stats = a->stats;
+}
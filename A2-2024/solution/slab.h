@@ -0,0 +1,42 @@
+#pragma once
+#include <stddef.h>
+
+// A small slab allocator for the variable store.
+//
+// Requests are rounded up to one of a handful of power-of-two size classes.
+// Each class carves its objects out of large slabs and keeps freed objects
+// on a free list, so a long session that keeps overwriting variables reuses
+// the same memory instead of scattering small mallocs across the heap.
+// Requests bigger than the largest class go straight to malloc.
+
+struct slab_allocator;
+
+struct slab_stats {
+    size_t bytes_requested; // sum of sizes passed to slab_alloc, live only
+    size_t bytes_in_use;    // sum of the (rounded up) objects handed out
+    size_t bytes_free;      // objects sitting on the free lists
+    size_t bytes_reserved;  // all memory obtained from malloc for slabs
+    size_t slab_count;      // number of slabs obtained from malloc
+    size_t large_count;     // live allocations too big for any class
+    size_t large_bytes;     // their capacity, as handed out
+};
+
+struct slab_allocator *slab_create();
+// Frees every slab at once, whether or not its objects were freed.
+void slab_destroy(struct slab_allocator *a);
+
+// Returns memory for at least size bytes. The usable size, which may be
+// larger than requested, is stored in *capacity if it is not NULL.
+void *slab_alloc(struct slab_allocator *a, size_t size, size_t *capacity);
+// capacity must be the usable size reported by slab_alloc, and size the
+// size that was originally requested (it's only used for statistics).
+void slab_free(struct slab_allocator *a, void *p, size_t size, size_t capacity);
+// The object p is now being used for size bytes rather than old_size.
+// Only updates statistics; it's the caller's job to check that it fits.
+void slab_resize_in_place(struct slab_allocator *a, size_t old_size, size_t size);
+
+// The usable size slab_alloc would hand out for a request of size bytes,
+// without allocating anything.
+size_t slab_capacity_for(size_t size);
+
+void slab_get_stats(struct slab_allocator *a, struct slab_stats *stats);
@@ -1,13 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "output.h"
 #include "pcb.h"
 #include "thread_scheduler.h"
 
 // Simple test program to demonstrate multi-threading
 int main() {
-    printf("Multi-threading Test Program\n");
-    printf("============================\n\n");
+    out_printf("Multi-threading Test Program\n");
+    out_printf("============================\n\n");
     
     // Create a simple process
     FILE *test_file = fopen("test_script.txt", "w");
@@ -22,21 +23,28 @@ int main() {
     // Create process from file
     struct PCB *pcb = create_process("test_script.txt");
     if (!pcb) {
-        printf("Failed to create process\n");
+        out_printf("Failed to create process\n");
         return 1;
     }
     
-    printf("Process created with PID: %zu\n", pcb->pid);
-    printf("Number of instructions: %zu\n", pcb->line_count);
+    out_printf("Process created with PID: %zu\n", pcb->pid);
+    out_printf("Number of instructions: %zu\n", pcb->program->line_count);
+    out_printf("In the process table: %s (by pid), %s (by script), %zu live\n",
+               find_process(pcb->pid) == pcb ? "yes" : "no",
+               find_processes_running("./test_script.txt") == pcb ? "yes" : "no",
+               process_count());
     
     // Run process with multi-threading
-    printf("\nRunning process with 4 threads...\n");
+    out_printf("\nRunning process with 4 threads...\n");
     run_process_multithreaded(pcb, 4);
     
     // Clean up
+    pid pid = pcb->pid;
     free_pcb(pcb);
+    out_printf("After cleanup: %s, %zu live\n",
+               find_process(pid) ? "still there" : "gone", process_count());
     unlink("test_script.txt");
     
-    printf("\nMulti-threading test completed!\n");
+    out_printf("\nMulti-threading test completed!\n");
     return 0;
 } 
\ No newline at end of file
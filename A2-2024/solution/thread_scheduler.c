@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
+#include "output.h"
 #include "thread_scheduler.h"
 #include "shellmemory.h"
 #include "shell.h"
@@ -147,13 +148,20 @@ int scheduler_has_work(struct thread_scheduler *scheduler) {
     return has_work;
 }
 
+static void report_instruction(struct TCB *thread, size_t instr) {
+    out_printf("Thread %zu executing instruction %zu\n", thread->tid, instr);
+}
+
+static thread_executor executor = report_instruction;
+
+void set_thread_executor(thread_executor execute) {
+    executor = execute;
+}
+
 struct TCB *run_thread_to_completion(struct TCB *thread) {
     while (tcb_has_next_instruction(thread)) {
         size_t instr = tcb_next_instruction(thread);
-        // Execute the instruction - this would need to be thread-safe
-        // simulate execution
-        printf("Thread %zu executing instruction %zu\n", thread->tid, instr);
-        usleep(1000); // Small delay to simulate execution
+        executor(thread, instr);
     }
     return NULL; // Thread completed
 }
@@ -161,9 +169,7 @@ struct TCB *run_thread_to_completion(struct TCB *thread) {
 struct TCB *run_thread_for_n_steps(struct TCB *thread, size_t n) {
     for (; n && tcb_has_next_instruction(thread); --n) {
         size_t instr = tcb_next_instruction(thread);
-        // Execute the instruction
-        printf("Thread %zu executing instruction %zu\n", thread->tid, instr);
-        usleep(1000); // Small delay to simulate execution
+        executor(thread, instr);
     }
     
     if (tcb_has_next_instruction(thread)) {
@@ -175,15 +181,20 @@ struct TCB *run_thread_for_n_steps(struct TCB *thread, size_t n) {
 
 void *thread_execution_function(void *arg) {
     struct TCB *thread = (struct TCB *)arg;
-    
-    // Execute the thread
-    while (tcb_has_next_instruction(thread)) {
-        size_t instr = tcb_next_instruction(thread);
-        // Execute the instruction - this need to be thread-safe
-        printf("Thread %zu executing instruction %zu\n", thread->tid, instr);
-        usleep(1000); // Small delay to simulate execution
+    struct out_order *order = thread->parent_pcb->output_order;
+    size_t instr;
+
+    // Instructions are executed outside of any lock: the variable store
+    // is safe to use from several threads (see shellmemory.c), so workers
+    // only synchronise to claim their next instruction.
+    while (tcb_claim_instruction(thread, &instr)) {
+        if (order) out_begin_instruction(order, instr);
+        executor(thread, instr);
+        if (order) out_end_instruction();
     }
-    
+    // The thread's output buffer is flushed as it exits, before anyone
+    // joining it carries on.
+
     return NULL;
 }
 
@@ -203,22 +214,32 @@ struct PCB *run_process_multithreaded(struct PCB *pcb, int num_threads) {
         }
     }
     
-    // Run the threads
-    while (scheduler_has_work(scheduler)) {
-        struct TCB *thread = get_next_thread(scheduler);
-        if (thread) {
-            struct TCB *result = run_thread_for_n_steps(thread, 1);
-            if (result) {
-                // Thread still has work, put it back in ready queue
-                add_thread_to_scheduler(scheduler, result);
-            } else {
-                // Thread completed
-                terminate_thread(scheduler, thread);
-                remove_thread_from_process(pcb, thread);
-                free_thread(thread);
-            }
-        }
-        usleep(1000); // Small delay between thread switches
+    // Whatever we printed before now must come out before the threads'
+    // output does.
+    out_flush();
+    if (out_get_ordered()) pcb->output_order = out_order_create(pcb->pc);
+
+    // Start every ready thread on its own pthread. We're the only one
+    // touching the thread list while they run, so we can walk it without
+    // the process mutex once they've all been added.
+    pthread_t *handles = malloc(num_threads * sizeof(pthread_t));
+    int started = 0;
+    struct TCB *thread;
+    while (started < num_threads && (thread = get_next_thread(scheduler))) {
+        pthread_create(&handles[started++], NULL, thread_execution_function, thread);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    free(handles);
+    out_order_free(pcb->output_order);
+    pcb->output_order = NULL;
+
+    // Every thread has run out of instructions to claim.
+    while ((thread = pcb->threads)) {
+        terminate_thread(scheduler, thread);
+        remove_thread_from_process(pcb, thread);
+        free_thread(thread);
     }
     
     // Clean up scheduler
@@ -22,10 +22,23 @@ void unblock_thread(struct thread_scheduler *scheduler, struct TCB *thread);
 void terminate_thread(struct thread_scheduler *scheduler, struct TCB *thread);
 int scheduler_has_work(struct thread_scheduler *scheduler);
 
+// Executes one instruction (numbered as by pcb_next_instruction) on
+// behalf of thread.
+typedef void (*thread_executor)(struct TCB *thread, size_t instr);
+// Install the function threads use to execute instructions. The default
+// only reports which instruction each thread would run; the shell installs
+// one that actually interprets the line. This keeps the thread scheduler
+// independent of the interpreter (test_thread doesn't link it).
+void set_thread_executor(thread_executor execute);
+
 // Thread execution functions
 struct TCB *run_thread_to_completion(struct TCB *thread);
 struct TCB *run_thread_for_n_steps(struct TCB *thread, size_t n);
+// pthread entry point for a worker thread. The process's threads share its
+// instructions: each one repeatedly claims the next unexecuted instruction
+// and executes it, until there are none left.
 void *thread_execution_function(void *arg);
 
-// Multi-threaded process execution
+// Multi-threaded process execution: runs the process's instructions on
+// num_threads real threads and returns once all of them have finished.
 struct PCB *run_process_multithreaded(struct PCB *pcb, int num_threads); 
\ No newline at end of file
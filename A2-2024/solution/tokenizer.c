@@ -0,0 +1,137 @@
+#include <ctype.h> // isspace
+#include <stdint.h>
+#include "shell.h" // MAX_USER_INPUT
+#include "scan.h"
+#include "tokenizer.h"
+
+static int word_ending(char c) {
+    return c == '\0' || c == '\n' || isspace(c) || c == ';';
+}
+
+// One byte at a time. These are exactly the rules parseInput has always
+// used, so compiled scripts split into the same words as the same lines
+// typed at the prompt; the vectorized version below must agree with this.
+static int tokenize_bytes(const char *line, size_t *pos, struct token *tokens,
+                          int max_tokens, int *chained) {
+    size_t ix = *pos;
+    size_t limit = *pos + MAX_USER_INPUT;
+    int count = 0;
+
+    while (line[ix] != '\n' && line[ix] != '\0' && ix < limit) {
+        // skip white spaces
+        for ( ; isspace(line[ix]) && line[ix] != '\n' && ix < limit; ix++);
+
+        // A semicolon ends this command.
+        if (line[ix] == ';') break;
+
+        // extract a word
+        size_t start = ix;
+        for ( ; !word_ending(line[ix]) && ix < limit; ix++);
+        if (ix == start) break;
+
+        if (count < max_tokens) {
+            tokens[count].offset = start;
+            tokens[count].length = ix - start;
+        }
+        count++;
+        if (line[ix] == '\0') break;
+    }
+
+    *chained = line[ix] == ';';
+    *pos = *chained ? ix + 1 : ix;
+    return count;
+}
+
+// Boiled down, the rules above say: the command ends at the first NUL,
+// newline or ';' (or after MAX_USER_INPUT characters, whichever is first),
+// and its words are the runs of non-whitespace before that.
+// So instead of looking at bytes one at a time, we classify 64 of them at
+// once into bit masks (scan.c) and find the runs with bit tricks: a word
+// starts at a non-space whose left neighbour is a space, and ends at a
+// non-space whose right neighbour is a space. Words can straddle blocks,
+// so one may still be open at the end of a block.
+// The first and last blocks run past the command on either side; see
+// scan.h for why that's safe.
+static int tokenize_blocks(const char *line, size_t *pos, struct token *tokens,
+                           int max_tokens, int *chained,
+                           scan_classifier classify) {
+    const char *start = line + *pos;
+    const char *limit = start + MAX_USER_INPUT;
+    const char *block = (const char *)((uintptr_t)start & ~(uintptr_t)63);
+    const char *end;
+    const char *word = NULL; // start of the open word, if any
+    int count = 0;
+
+#define WORD(from, to) do { \
+        if (count < max_tokens) { \
+            tokens[count].offset = (from) - line; \
+            tokens[count].length = (to) - (from); \
+        } \
+        count++; \
+    } while (0)
+
+    for ( ; ; block += 64) {
+        uint64_t spaces, stops;
+        classify(block, &spaces, &stops);
+        if (block < start) {
+            // Ignore the bytes before the command.
+            uint64_t before = (1ULL << (start - block)) - 1;
+            spaces |= before;
+            stops &= ~before;
+        }
+        if (limit - block < 64) {
+            // Stop at the limit, as if there was a ';' there.
+            stops |= ~((1ULL << (limit - block)) - 1);
+        }
+
+        int stop = stops ? __builtin_ctzll(stops) : 64;
+        uint64_t in_command = stop == 64 ? ~0ULL : (1ULL << stop) - 1;
+        uint64_t chars = ~spaces & in_command;
+        uint64_t starts = chars & ~((chars << 1) | (uint64_t)(word != NULL));
+        uint64_t ends = chars & ~(chars >> 1);
+        if (stop == 64 && (chars >> 63)) {
+            // The last word runs on into the next block.
+            ends &= ~(1ULL << 63);
+        }
+
+        if (word) {
+            if (!(chars & 1)) {
+                WORD(word, block);
+                word = NULL;
+            } else if (ends) {
+                WORD(word, block + __builtin_ctzll(ends) + 1);
+                ends &= ends - 1;
+                word = NULL;
+            }
+        }
+        while (starts) {
+            const char *from = block + __builtin_ctzll(starts);
+            starts &= starts - 1;
+            if (ends) {
+                WORD(from, block + __builtin_ctzll(ends) + 1);
+                ends &= ends - 1;
+            } else {
+                word = from;
+            }
+        }
+
+        if (stop < 64) {
+            end = block + stop;
+            break;
+        }
+    }
+#undef WORD
+
+    *chained = *end == ';';
+    *pos = (end - line) + (*chained ? 1 : 0);
+    return count;
+}
+
+int tokenize_command(const char *line, size_t *pos, struct token *tokens,
+                     int max_tokens, int *chained) {
+    scan_classifier classify = scan_get_classifier();
+    if (classify) {
+        return tokenize_blocks(line, pos, tokens, max_tokens, chained, classify);
+    }
+    return tokenize_bytes(line, pos, tokens, max_tokens, chained);
+}
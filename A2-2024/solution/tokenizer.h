@@ -0,0 +1,17 @@
+#pragma once
+#include <stddef.h>
+
+// A word of a command, as a slice of the line it came from.
+struct token {
+    size_t offset;
+    size_t length;
+};
+
+// Split the command starting at line[*pos] into words. A command ends at a
+// ';', a newline or the end of the line, and (like user input) is at most
+// MAX_USER_INPUT characters long.
+// Stores the first max_tokens words in tokens, and returns how many words
+// there were, which can be more than max_tokens. Sets *chained iff the
+// command ended at a ';', and advances *pos to the next command in the chain.
+int tokenize_command(const char *line, size_t *pos, struct token *tokens,
+                     int max_tokens, int *chained);